@@ -2,13 +2,19 @@
 #include "mol_bubble.h"
 
 enum { MAX_COUNTER_LENGTH = 8, MAX_DISTANCE_LENGTH = 32 };
-static const GPathInfo COMPASS_PATH_INFO = {
-  .num_points = 4,
-  .points = (GPoint []) {{0,-30}, {24,18}, {0,4}, {-24,18}} // center at 0,0
-};
+enum { COMPASS_SIZE = 80, COMPASS_POINTS = 4 };
+enum { COMPASS_STEPS = 64 }; // angular resolution of the needle, number of pre-rotated frames
+enum { COMPASS_FILTER_DEGREES = 2 }; // heading change needed for a new compass sample
+enum { COMPASS_DEADBAND = TRIG_MAX_ANGLE/COMPASS_STEPS/2 }; // smaller target changes are jitter
+enum { COMPASS_SMOOTHING = 2, COMPASS_EASING = 4 }; // divisors of target and needle movement
+enum { COMPASS_ANIMATION_MS = 500 }; // easing runs in such slices, until the needle is on target
+enum { DEAD_RECKONING_MS = 1000 }; // distance refresh between fixes
+static const GPoint COMPASS_POINTS_INFO[COMPASS_POINTS] = {{0,-30}, {24,18}, {0,4}, {-24,18}}; // center at 0,0
 
 static Window *p_window;
-static GPath* p_compass_path;
+static GPoint p_compass_frames[COMPASS_STEPS][COMPASS_POINTS]; // needle rotated to each step, centered in layer
+static GPath s_compass_path = { .num_points = COMPASS_POINTS };
+static int n_compass_frame = 0;
 static Layer *p_compass_layer;
 static TextLayer *p_station_name_layer;
 static TextLayer *p_calibration_layer;
@@ -19,51 +25,116 @@ static TextLayer* p_counter_layer;
 static char p_counter_str[MAX_COUNTER_LENGTH];
 #endif //  PBL_PLATFORM_BASALT
 static char p_distance_str[MAX_DISTANCE_LENGTH];
-static CompassHeading n_compass_start_angle, n_compass_angle, n_compass_target_angle;
+static char p_station_name_str[MAX_STATION_NAME_LENGTH];
+static CompassHeading n_compass_heading, n_compass_angle, n_compass_target_angle;
+static bool b_compass_heading_valid = false;
 static Animation* p_compass_animation = NULL;
+static AppTimer* p_reckoning_timer = NULL;
 
 static bool is_visible()
 {
     return window_is_loaded(p_window);
 }
 
+static CompassHeading angle_diff(CompassHeading to, CompassHeading from)
+{   // signed shortest rotation between two angles
+    return (to - from + 3*TRIG_MAX_ANGLE/2) % TRIG_MAX_ANGLE - TRIG_MAX_ANGLE/2;
+}
+
 static void set_compass_direction(Animation* animation, const AnimationProgress progress)
-{
-    CompassHeading diff = (n_compass_target_angle - n_compass_start_angle + 3*TRIG_MAX_ANGLE/2) % TRIG_MAX_ANGLE - TRIG_MAX_ANGLE/2;
-    n_compass_angle = (n_compass_start_angle +
-        diff*(progress-ANIMATION_NORMALIZED_MIN)/(ANIMATION_NORMALIZED_MAX-ANIMATION_NORMALIZED_MIN)) % TRIG_MAX_ANGLE;
-    //APP_LOG(APP_LOG_LEVEL_DEBUG, "Setting compass angle to: %u", (unsigned int)n_compass_angle);
-    gpath_rotate_to(p_compass_path, n_compass_angle);
-    layer_mark_dirty(p_compass_layer);
+{   // ease the needle towards the target
+    CompassHeading diff = angle_diff(n_compass_target_angle, n_compass_angle);
+    if (diff)
+    {
+        CompassHeading step = diff / COMPASS_EASING;
+        n_compass_angle = (n_compass_angle + (step ? step : diff) + TRIG_MAX_ANGLE) % TRIG_MAX_ANGLE;
+        //APP_LOG(APP_LOG_LEVEL_DEBUG, "Setting compass angle to: %u", (unsigned int)n_compass_angle);
+        int frame = ((n_compass_angle + TRIG_MAX_ANGLE/COMPASS_STEPS/2) * COMPASS_STEPS / TRIG_MAX_ANGLE) % COMPASS_STEPS;
+        if (frame != n_compass_frame)
+        {   // redraw only if the needle actually moves
+            n_compass_frame = frame;
+            layer_mark_dirty(p_compass_layer);
+        }
+    }
 }
 
-static void update_compass_direction(CompassHeading heading)
-{
-    if (is_visible())
+static void start_compass_animation();
+
+static void compass_animation_stopped(Animation *animation, bool finished, void *context)
+{   // unscheduled animations are cleaned up by stop_animation()
+    if (finished)
+    {
+        p_compass_animation = NULL;
+#ifdef PBL_PLATFORM_APLITE
+        animation_destroy(animation);
+#endif
+        if (angle_diff(n_compass_target_angle, n_compass_angle))
+        {   // not there yet
+            start_compass_animation();
+        }
+    }
+}
+
+static void start_compass_animation()
+{   // if not running already, the needle rests otherwise
+    static const AnimationImplementation compass_animation = { .update = set_compass_direction };
+    if (p_compass_animation || !is_visible() || !angle_diff(n_compass_target_angle, n_compass_angle))
+    {
+        return;
+    }
+    p_compass_animation = animation_create();
+    animation_set_implementation(p_compass_animation, &compass_animation);
+    animation_set_duration(p_compass_animation, COMPASS_ANIMATION_MS);
+    animation_set_handlers(p_compass_animation, (AnimationHandlers){ .stopped = compass_animation_stopped }, NULL);
+    animation_schedule(p_compass_animation);
+}
+
+static void update_compass_direction(bool smooth)
+{   // retarget the needle to the last known heading
+    if (is_visible() && b_compass_heading_valid && s_selected_station != NO_STATION)
     {
-        n_compass_target_angle = (heading - s_selected_station->bearing + TRIG_MAX_ANGLE) % TRIG_MAX_ANGLE;
-        stop_animation(&p_compass_animation);
-        n_compass_start_angle = n_compass_angle;
-        APP_LOG(APP_LOG_LEVEL_DEBUG, "Scheduling compass animation from %u to %u",
-                (unsigned int)n_compass_start_angle, (unsigned int)n_compass_target_angle);
-        static const AnimationImplementation compass_animation = { .update = set_compass_direction };
-        p_compass_animation = animation_create();
-        animation_set_implementation(p_compass_animation, &compass_animation);
-        animation_set_curve(p_compass_animation, AnimationCurveLinear);
-        animation_schedule(p_compass_animation);
-        /*       
+        CompassHeading target = (n_compass_heading - station_estimated_bearing(s_selected_station) + TRIG_MAX_ANGLE) % TRIG_MAX_ANGLE;
+        CompassHeading diff = angle_diff(target, n_compass_target_angle);
+        if (smooth)
+        {   // low pass filter with a deadband against jitter
+            if (abs(diff) < COMPASS_DEADBAND)
+            {
+                return;
+            }
+            diff /= COMPASS_SMOOTHING;
+        }
+        n_compass_target_angle = (n_compass_target_angle + diff + TRIG_MAX_ANGLE) % TRIG_MAX_ANGLE;
+        start_compass_animation();
+        /*
         snprintf(p_distance_str, MAX_DISTANCE_LENGTH, "%d %ld %ld",
-            s_selected_station->distance, heading, s_selected_station->bearing);
+            station_distance(s_selected_station), n_compass_heading, station_bearing(s_selected_station));
         text_layer_set_text(p_distance_layer, p_distance_str);
         */
     }
 }
 
+static void reckoning_timer_fired(void *context)
+{   // walk on from the last fix, selected station only
+    p_reckoning_timer = app_timer_register(DEAD_RECKONING_MS, reckoning_timer_fired, NULL);
+    estimate_station(s_selected_station, n_compass_heading, b_compass_heading_valid);
+    compass_window__update_distance();
+}
+
+static void stop_reckoning()
+{
+    if (p_reckoning_timer)
+    {
+        app_timer_cancel(p_reckoning_timer);
+        p_reckoning_timer = NULL;
+    }
+}
+
 static void update_station_name()
 {
     if (is_visible())
     {
-        text_layer_set_text(p_station_name_layer, s_selected_station->name);    
+        text_layer_set_text(p_station_name_layer,
+            s_selected_station != NO_STATION ? station_name(s_selected_station, p_station_name_str) : "");
     }
 }
 
@@ -75,20 +146,40 @@ static void set_calibration_text_visibility(bool visible)
 static void compass_handler(CompassHeadingData headingData)
 {
     set_calibration_text_visibility(headingData.compass_status != CompassStatusCalibrated);
-    update_compass_direction(headingData.true_heading);
+    n_compass_heading = headingData.true_heading;
+    b_compass_heading_valid = true;
+    update_compass_direction(true);
+}
+
+static void build_compass_frames()
+{   // same transformation as gpath_rotate_to() and gpath_move_to(), done once
+    for (int f = 0; f < COMPASS_STEPS; f++)
+    {
+        int32_t angle = f * TRIG_MAX_ANGLE / COMPASS_STEPS;
+        int32_t sine = sin_lookup(angle), cosine = cos_lookup(angle);
+        for (int i = 0; i < COMPASS_POINTS; i++)
+        {
+            GPoint p = COMPASS_POINTS_INFO[i];
+            p_compass_frames[f][i] = GPoint(
+                COMPASS_SIZE/2 + (p.x*cosine - p.y*sine) / TRIG_MAX_RATIO,
+                COMPASS_SIZE/2 + (p.x*sine + p.y*cosine) / TRIG_MAX_RATIO);
+        }
+    }
 }
 
 static void layer_update(Layer *layer, GContext* ctx)
 {
+    render_bench__draw(RENDER_COMPASS);
+    s_compass_path.points = p_compass_frames[n_compass_frame];
 #ifdef PBL_COLOR
     graphics_context_set_fill_color(ctx, GColorRed);
-    gpath_draw_filled(ctx, p_compass_path);
+    gpath_draw_filled(ctx, &s_compass_path);
     graphics_context_set_stroke_color(ctx, GColorInchworm);
     graphics_context_set_stroke_width(ctx, 4);
-    gpath_draw_outline(ctx, p_compass_path);
+    gpath_draw_outline(ctx, &s_compass_path);
 #else
     graphics_context_set_fill_color(ctx, GColorBlack);
-    gpath_draw_filled(ctx, p_compass_path);
+    gpath_draw_filled(ctx, &s_compass_path);
 #endif
 }
 
@@ -116,9 +207,8 @@ static void window_load()
     layer_add_child(window_layer, text_layer_get_layer(p_station_name_layer));
     
     // compass
-    p_compass_path = gpath_create(&COMPASS_PATH_INFO);
-    gpath_move_to(p_compass_path, GPoint(40, 40));
-    p_compass_layer = layer_create(GRect((bounds.size.w-80)/2, 54+top, 80, 80));
+    build_compass_frames();
+    p_compass_layer = layer_create(GRect((bounds.size.w-COMPASS_SIZE)/2, 54+top, COMPASS_SIZE, COMPASS_SIZE));
     layer_set_update_proc(p_compass_layer, layer_update);
     layer_add_child(window_layer, bitmap_layer_get_layer((BitmapLayer*)p_compass_layer));
     
@@ -135,28 +225,35 @@ static void window_load()
     text_layer_set_text(p_calibration_layer, "Compass is calibrating!\n\nMove your wrist around to aid calibration.");
     set_calibration_text_visibility(false);
     layer_add_child(window_layer, text_layer_get_layer(p_calibration_layer));
+    render_bench__attach(p_window);
 }
 
 static void window_appear()
 {
+    n_compass_angle = n_compass_target_angle = 0;
+    n_compass_frame = 0;
+    b_compass_heading_valid = false;
     update_station_name();
     compass_window__update_distance();
-    n_compass_angle = 0;
+    compass_service_set_heading_filter(DEG_TO_TRIGANGLE(COMPASS_FILTER_DEGREES));
     compass_service_subscribe(compass_handler);
+    p_reckoning_timer = app_timer_register(DEAD_RECKONING_MS, reckoning_timer_fired, NULL);
 }
 
 static void window_disappear()
 {
+    stop_reckoning();
+    stop_animation(&p_compass_animation);
     compass_service_unsubscribe();
 }
 
 static void window_unload()
 {
     stop_animation(&p_compass_animation);
+    render_bench__detach(p_window);
     text_layer_destroy(p_calibration_layer);
     text_layer_destroy(p_distance_layer);
     layer_destroy(p_compass_layer);
-    gpath_destroy(p_compass_path);
     text_layer_destroy(p_station_name_layer);
 }
 
@@ -188,7 +285,7 @@ static void button_handler(ClickRecognizerRef recognizer, void *context)
 {
     bool up = click_recognizer_get_button_id(recognizer) == BUTTON_ID_UP;
     MenuIndex index = station_menu__get_selection();
-    bool ok = up ? index.row > 0 : index.row+1 < s_stations_size;
+    bool ok = up ? index.row > 0 : index.row+1 < view_size();
     if (ok)
     {
         index.row += up ? -1 : 1;
@@ -215,10 +312,18 @@ static void button_handler(ClickRecognizerRef recognizer, void *context)
 #endif
 }
 
+static void view_handler(ClickRecognizerRef recognizer, void *context)
+{
+    select_view((s_view + 1) % VIEW_COUNT);
+    update_station_name();
+    compass_window__update_distance();
+}
+
 static void click_config_provider()
 {
     window_single_click_subscribe(BUTTON_ID_UP, button_handler);
     window_single_click_subscribe(BUTTON_ID_DOWN, button_handler);
+    window_long_click_subscribe(BUTTON_ID_SELECT, 0, view_handler, NULL);
 }
 
 ////////////////   E X P O R T E D   F U N C T I O N S   ////////////////
@@ -246,15 +351,28 @@ void compass_window__show()
     window_stack_push(p_window, true);
 }
 
+void compass_window__update_station()
+{
+    update_station_name();
+    compass_window__update_distance();
+}
+
 void compass_window__update_distance()
 {
     if (is_visible())
     {
 #ifdef PBL_PLATFORM_BASALT
-        snprintf(p_counter_str, MAX_COUNTER_LENGTH, "%d/%d", station_menu__get_selection().row+1, s_stations_size);
+        snprintf(p_counter_str, MAX_COUNTER_LENGTH, "%d/%d",
+                 s_selected_station != NO_STATION ? station_menu__get_selection().row+1 : 0, view_size());
         text_layer_set_text(p_counter_layer, p_counter_str);
 #endif
-        snprintf(p_distance_str, MAX_DISTANCE_LENGTH, "%d meters", s_selected_station->distance);
+        if (s_selected_station == NO_STATION)
+        {   // nothing selected, e.g. the station set changed under us
+            text_layer_set_text(p_distance_layer, "");
+            return;
+        }
+        snprintf(p_distance_str, MAX_DISTANCE_LENGTH, "%d meters", station_estimated_distance(s_selected_station));
         text_layer_set_text(p_distance_layer, p_distance_str);
+        update_compass_direction(false); // bearing may have changed
     }
 }
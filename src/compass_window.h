@@ -5,3 +5,4 @@ void compass_window__deinit();
 
 void compass_window__show();
 void compass_window__update_distance();
+void compass_window__update_station(); // selection may have changed
@@ -1,87 +1,384 @@
 #include <pebble.h>
 #include "mol_bubble.h"
 
-static void copy_name(char *dst, const char *src)
+enum { LINK_WATCHDOG_MS = 5000, HANDSHAKE_RETRY_MS = 1000 };
+enum { MIN_INBOX_SIZE = 256, OUTBOX_SIZE = 128 };
+// station record in a KEY_STATIONS batch:
+// tile x, y (int8), x, y (int16 LE), racks (uint16 LE), name length, encoded name
+enum { STATION_RECORD_HEADER = 9 };
+// station id in a KEY_IDS batch: id, record checksum (uint16 LE)
+enum { STATION_ID_SIZE = 4 };
+// resync request: per kind, kind and range count, then (start, count) uint16 LE pairs
+enum { RESYNC_MAX_RANGES = 16, RESYNC_MAX_ROUNDS = 5 };
+enum { RESYNC_MAX_LENGTH = 2*RESYNC_KINDS + 4*RESYNC_MAX_RANGES };
+typedef struct ResyncRequest
 {
-    int l = strlen(src);
-    if (l+1 < MAX_STATION_NAME_LENGTH)
+    uint8_t data[RESYNC_MAX_LENGTH];
+    int length;
+    int ranges;
+} ResyncRequest;
+static AppTimer *p_link_watchdog = NULL;
+static uint32_t n_inbox_size = 0;
+static bool b_handshake_pending = false;
+static AppTimer *p_handshake_timer = NULL; // one retry at a time
+static int32_t n_next_seq = -1; // next expected data message, -1 if unknown
+static int n_resync_rounds = 0;
+static bool b_bikes_burst = false; // bike update burst in progress
+static bool b_count_requested = false;
+
+static int16_t read_int16(const uint8_t *p)
+{
+    return (int16_t)(p[0] | p[1] << 8);
+}
+
+static void release_link()
+{
+    if (p_link_watchdog)
+    {
+        app_timer_cancel(p_link_watchdog);
+        p_link_watchdog = NULL;
+    }
+    app_comm_set_sniff_interval(SniffIntervalNormal);
+}
+
+static bool send_resync(const uint8_t *request, int length)
+{
+    DictionaryIterator *iter;
+    if (app_message_outbox_begin(&iter) != APP_MSG_OK)
+    {
+        return false;
+    }
+    dict_write_data(iter, KEY_RESYNC, request, length);
+    dict_write_end(iter);
+    app_message_outbox_send();
+    return true;
+}
+
+static void add_missing(ResyncRequest *request, int kind, const uint8_t *bitmap, int limit)
+{   // the index ranges below limit not received yet
+    int start = bitmap_next(bitmap, 0, limit, false);
+    if (start >= limit || request->ranges >= RESYNC_MAX_RANGES)
+    {
+        return;
+    }
+    uint8_t *p = request->data + request->length, *head = p;
+    *p++ = kind;
+    *p++ = 0; // range count
+    while (start < limit && request->ranges < RESYNC_MAX_RANGES)
+    {
+        int end = bitmap_next(bitmap, start, limit, true);
+        *p++ = start & 0xFF;
+        *p++ = start >> 8;
+        *p++ = (end-start) & 0xFF;
+        *p++ = (end-start) >> 8;
+        head[1]++;
+        request->ranges++;
+        start = bitmap_next(bitmap, end, limit, false);
+    }
+    request->length = p - request->data;
+    APP_LOG(APP_LOG_LEVEL_INFO, "Requesting %d missing range(s) of kind %d", head[1], kind);
+}
+
+static bool send_request(const ResyncRequest *request)
+{   // every request counts towards giving up
+    if (request->length == 0 || n_resync_rounds >= RESYNC_MAX_ROUNDS)
+    {
+        return false;
+    }
+    n_resync_rounds++;
+    send_resync(request->data, request->length);
+    return true;
+}
+
+static bool request_missing(int kind, const uint8_t *bitmap, int limit)
+{   // ask the phone for the index ranges below limit not received yet
+    ResyncRequest request = { .length = 0 };
+    add_missing(&request, kind, bitmap, limit);
+    return send_request(&request);
+}
+
+static bool request_count()
+{
+    static const uint8_t request[] = { RESYNC_COUNT, 0 };
+    return send_resync(request, sizeof(request));
+}
+
+static void give_up_resync()
+{   // show what arrived rather than loading forever, the next publish starts over
+    APP_LOG(APP_LOG_LEVEL_ERROR, "Giving up resync after %d rounds!", n_resync_rounds);
+    if (s_pending.ids)
+    {   // station set never arrived
+        station_menu__signal_error("\n\nConnection lost\nPlease try later!");
+        return;
+    }
+    s_pending.stations = 0;
+    s_pending.bikes = false;
+    update_stations();
+    station_menu__refresh_icons();
+    station_menu__refresh_list();
+}
+
+static bool resync()
+{   // returns true if anything is still missing and has been requested
+    // Everything missing goes in one request, indices of stations and bikes
+    // refer to the announced set, so they wait until it is remapped.
+    ResyncRequest request = { .length = 0 };
+    add_missing(&request, RESYNC_DICTIONARY, s_tokens_received, s_dictionary_size);
+    if (s_pending.ids)
     {
-        strcpy(dst, src);
+        add_missing(&request, RESYNC_IDS, s_ids_received, s_incoming_size);
     }
     else
     {
-        l = MAX_STATION_NAME_LENGTH-4; // ellipsis + terminating null
-        while (src[l] & 0x80)
-            l--; // find last ASCII char
-        strncpy(dst, src, l);
-        dst[l++] = 0xE2; // horizontal ellipsis
-        dst[l++] = 0x80;
-        dst[l++] = 0xA6;
-        dst[l] = '\0';
+        if (s_pending.stations)
+            add_missing(&request, RESYNC_STATIONS, s_stations_received, s_stations_size);
+        if (b_bikes_burst)
+            add_missing(&request, RESYNC_BIKES, s_bikes_received, s_stations_size);
+    }
+    if (send_request(&request))
+    {
+        return true;
+    }
+    if (request.length)
+    {   // hopeless, keep the round count so the watchdog does not start over
+        give_up_resync();
+    }
+    else
+    {   // transfer complete
+        n_resync_rounds = 0;
+    }
+    // next bike burst starts afresh
+    b_bikes_burst = false;
+    if (s_bikes_received)
+    {
+        memset(s_bikes_received, 0, bitmap_size(s_stations_size));
+    }
+    return false;
+}
+
+static void link_watchdog_fired(void *context)
+{
+    APP_LOG(APP_LOG_LEVEL_WARNING, "Bulk transfer stalled");
+    p_link_watchdog = NULL;
+    if (resync())
+    {   // stay in reduced sniff mode for the replies
+        p_link_watchdog = app_timer_register(LINK_WATCHDOG_MS, link_watchdog_fired, NULL);
+    }
+    else
+    {
+        release_link();
     }
 }
 
+static void boost_link()
+{   // keep the link in reduced sniff mode while a bulk transfer is streaming
+    if (p_link_watchdog)
+    {
+        app_timer_reschedule(p_link_watchdog, LINK_WATCHDOG_MS);
+    }
+    else
+    {
+        app_comm_set_sniff_interval(SniffIntervalReduced);
+        p_link_watchdog = app_timer_register(LINK_WATCHDOG_MS, link_watchdog_fired, NULL);
+    }
+}
+
+static void finish_transfer()
+{   // last message of a transfer arrived, fill in the gaps if there are any
+    if (resync())
+    {
+        boost_link();
+    }
+    else
+    {
+        release_link();
+    }
+}
+
+static bool check_sequence(DictionaryIterator *iterator)
+{   // returns true if data messages have been lost before this one
+    Tuple *t = dict_find(iterator, KEY_SEQ);
+    if (t == NULL)
+    {
+        return false;
+    }
+    int32_t seq = t->value->int32;
+    bool gap = n_next_seq >= 0 && seq > n_next_seq;
+    if (gap)
+    {
+        APP_LOG(APP_LOG_LEVEL_WARNING, "Lost %d message(s) before #%d", (int)(seq - n_next_seq), (int)seq);
+    }
+    if (seq >= n_next_seq)
+    {   // resync replies may arrive out of order
+        n_next_seq = seq + 1;
+    }
+    return gap;
+}
+
 static void inbox_received_callback(DictionaryIterator *iterator, void *context)
 {
     Tuple *t;
+    bool gap = check_sequence(iterator);
     
     if ((t = dict_find(iterator, KEY_NUM_STATIONS)) != NULL)
     {   // station publish/update begins, allocate vector (if necesary)
+        n_resync_rounds = 0;
+        b_count_requested = false;
+        Tuple *dictionary_size = dict_find(iterator, KEY_DICTIONARY_SIZE);
+        Tuple *dictionary_id = dict_find(iterator, KEY_DICTIONARY_ID);
+        if (dictionary_size != NULL)
+        {
+            reallocate_dictionary(dictionary_size->value->int32, dictionary_id != NULL ? dictionary_id->value->int32 : 0);
+        }
         reallocate_stations(t->value->int32);
-        if (t->value->int32 == 0)
+        trace__mark(TRACE_STATION_COUNT);
+        if (t->value->int32 > 0)
+        {
+            boost_link();
+        }
+        else
         {
             station_menu__signal_error("\n\nServer issue\nPlease try later!");
         }
         station_menu__refresh_list();
     }
-    else if ((t = dict_find(iterator, KEY_INDEX)) != NULL)
-    {   // station publish package
-        int i = t->value->int32;
-        if (i < s_stations_size)
+    else if ((t = dict_find(iterator, KEY_DICTIONARY)) != NULL)
+    {   // name dictionary package, (length, bytes) of consecutive tokens
+        const uint8_t *p = t->value->data, *end = p + t->length;
+        int i = (t = dict_find(iterator, KEY_INDEX)) != NULL ? t->value->int32 : 0;
+        if (gap)
+        {   // fetch what was lost before this batch
+            request_missing(RESYNC_DICTIONARY, s_tokens_received, i < s_dictionary_size ? i : s_dictionary_size);
+        }
+        for (; p < end && p + 1 + *p <= end; p += 1 + *p, i++)
         {
-            Station *station = &s_stations[i];
-            t = dict_read_first(iterator);
-            while (t != NULL)
+            set_token(i, (const char*)p+1, *p);
+        }
+        boost_link();
+        // names may have changed
+        station_menu__refresh_list();
+    }
+    else if ((t = dict_find(iterator, KEY_IDS)) != NULL)
+    {   // ids of the announced station set, from index
+        const uint8_t *p = t->value->data, *end = p + t->length;
+        int i = (t = dict_find(iterator, KEY_INDEX)) != NULL ? t->value->int32 : 0;
+        if (!s_pending.ids)
+        {   // station count header got lost, or a duplicate
+            if (gap && !b_count_requested)
             {
-                switch (t->key)
-                {
-                case KEY_NAME:
-                    copy_name(station->name, t->value->cstring);
-                    break;
-                case KEY_X:
-                    station->coords.x = t->value->int32;
-                    break;
-                case KEY_Y:
-                    station->coords.y = t->value->int32;
-                    break;
-                case KEY_RACKS:
-                    station->racks = t->value->int32;
-                }
-                t = dict_read_next(iterator);
+                b_count_requested = request_count();
             }
-            if (s_pending.stations)
+            return;
+        }
+        if (gap)
+        {   // fetch what was lost before this batch
+            request_missing(RESYNC_IDS, s_ids_received, i < s_incoming_size ? i : s_incoming_size);
+        }
+        for (; p + STATION_ID_SIZE <= end; p += STATION_ID_SIZE, i++)
+        {
+            set_station_id(i, (uint16_t)read_int16(p), (uint16_t)read_int16(p+2));
+        }
+        if (s_pending.ids)
+        {
+            boost_link();
+        }
+        else
+        {   // remapped, ask for the stations not stored
+            if (!s_pending.stations)
             {
-                s_pending.stations--;
-                station_menu__refresh_icons();
-            }
-            if (i == s_stations_size-1)
-            {   // received last refresh, update
-                update_stations();
+                trace__mark(TRACE_STATIONS_COMPLETE);
             }
-            // update display
+            finish_transfer();
+            station_menu__refresh_icons();
             station_menu__refresh_list();
-            if (station == s_selected_station)
+            compass_window__update_station();
+        }
+    }
+    else if (s_pending.ids && (dict_find(iterator, KEY_INDEX) != NULL || dict_find(iterator, KEY_UPDATE) != NULL))
+    {   // indices refer to the announced set, get them again once it is remapped
+        b_bikes_burst |= dict_find(iterator, KEY_UPDATE) != NULL;
+        boost_link();
+    }
+    else if ((t = dict_find(iterator, KEY_INDEX)) != NULL)
+    {   // station publish package, a batch of consecutive stations
+        int i = t->value->int32;
+        bool pending = s_pending.stations, selected = false;
+        if (gap && pending)
+        {   // fetch what was lost before this batch
+            request_missing(RESYNC_STATIONS, s_stations_received, i < s_stations_size ? i : s_stations_size);
+        }
+        if (s_stations_size == 0 && !b_count_requested)
+        {   // station count header got lost
+            b_count_requested = request_count();
+        }
+        if ((t = dict_find(iterator, KEY_STATIONS)) != NULL)
+        {
+            const uint8_t *p = t->value->data, *end = p + t->length;
+            for (; p + STATION_RECORD_HEADER <= end && i < s_stations_size; i++)
             {
-                update_station(station);
-                compass_window__update_distance();
+                int l = p[8];
+                if (p + STATION_RECORD_HEADER + l > end)
+                    break; // truncated record
+                Coordinates coords = { (int8_t)p[0], (int8_t)p[1], read_int16(p+2), read_int16(p+4) };
+                set_station(i, coords, read_int16(p+6), (const char*)p + STATION_RECORD_HEADER, l);
+                p += STATION_RECORD_HEADER + l;
+                if (!bitmap_get(s_stations_received, i))
+                {   // not a duplicate
+                    bitmap_set(s_stations_received, i);
+                    if (s_pending.stations)
+                        s_pending.stations--; // unless given up on
+                }
+                if (i == s_selected_station)
+                {
+                    update_station(i);
+                    selected = true;
+                }
             }
         }
+        if (pending)
+        {
+            station_menu__refresh_icons();
+        }
+        if (i == s_stations_size || (pending && !s_pending.stations))
+        {   // received last refresh, update
+            trace__mark(TRACE_STATIONS_COMPLETE);
+            finish_transfer();
+            update_stations();
+        }
+        else
+        {
+            boost_link();
+        }
+        // update display
+        station_menu__refresh_list();
+        if (selected)
+        {
+            compass_window__update_distance();
+        }
     }
     else if ((t = dict_find(iterator, KEY_UPDATE)) != NULL)
     {   // station update package
-        for (int start = t->value->data[0], i = 1; i < t->length && start+i-1 < s_stations_size; i++)
+        int start = t->value->data[0] | t->value->data[1] << 8;
+        if (gap && b_bikes_burst)
+        {   // fetch what was lost before this chunk
+            request_missing(RESYNC_BIKES, s_bikes_received, start < s_stations_size ? start : s_stations_size);
+        }
+        b_bikes_burst = true;
+        trace__mark(TRACE_FIRST_BIKES);
+        int count = (t->length-2) / 2; // uint16 LE bike counts follow the start index
+        for (int i = 0; i < count && start+i < s_stations_size; i++)
         {
-            s_stations[start+i-1].bikes = t->value->data[i];
+            set_station_bikes(start+i, (uint16_t)read_int16(&t->value->data[2+2*i]));
+            bitmap_set(s_bikes_received, start+i);
+        }
+        if (start+count < s_stations_size &&
+            bitmap_next(s_bikes_received, 0, s_stations_size, false) < s_stations_size)
+        {   // more chunks to come
+            boost_link();
+        }
+        else if (!s_pending.stations)
+        {   // last chunk of a burst, and no publish in progress
+            finish_transfer();
         }
         if (s_pending.bikes)
         {
@@ -93,22 +390,29 @@ static void inbox_received_callback(DictionaryIterator *iterator, void *context)
     }
     else
     {   // position update package
+        Coordinates coords = s_last_known_coords;
         t = dict_read_first(iterator);
         while (t != NULL)
         {
             switch (t->key)
             {
                 case KEY_X:
-                    s_last_known_coords.x = t->value->int32;
+                    coords.x = t->value->int32;
                     break;
                 case KEY_Y:
-                    s_last_known_coords.y = t->value->int32;
+                    coords.y = t->value->int32;
+                    break;
+                case KEY_TILE:
+                    coords.tile_x = (int8_t)t->value->data[0];
+                    coords.tile_y = (int8_t)t->value->data[1];
                     break;
             }
             t = dict_read_next(iterator);
         }
+        set_position(coords);
         if (s_pending.location)
         {
+            trace__mark(TRACE_FIRST_POSITION);
             s_pending.location = false;
             station_menu__refresh_icons();
         }
@@ -119,19 +423,75 @@ static void inbox_received_callback(DictionaryIterator *iterator, void *context)
     }
 }
 
+static void send_handshake(void *context);
+
+static void retry_handshake()
+{
+    if (!p_handshake_timer || !app_timer_reschedule(p_handshake_timer, HANDSHAKE_RETRY_MS))
+    {
+        p_handshake_timer = app_timer_register(HANDSHAKE_RETRY_MS, send_handshake, NULL);
+    }
+}
+
+static void send_handshake(void *context)
+{   // tell the phone how large messages we can take
+    DictionaryIterator *iter;
+    p_handshake_timer = NULL;
+    b_handshake_pending = true;
+    if (app_message_outbox_begin(&iter) != APP_MSG_OK)
+    {
+        retry_handshake();
+        return;
+    }
+    dict_write_uint32(iter, KEY_INBOX_SIZE, n_inbox_size);
+#ifdef PBL_PLATFORM_BASALT
+    dict_write_cstring(iter, KEY_PLATFORM, "basalt");
+#else
+    dict_write_cstring(iter, KEY_PLATFORM, "aplite");
+#endif
+    dict_write_end(iter);
+    app_message_outbox_send();
+}
+
+static uint32_t choose_inbox_size()
+{   // largest inbox possible, but leave most of the heap to station data
+    uint32_t size = app_message_inbox_size_maximum();
+    uint32_t budget = heap_bytes_free() / 4;
+    if (size > budget)
+    {
+        size = budget > MIN_INBOX_SIZE ? budget : MIN_INBOX_SIZE;
+    }
+    return size;
+}
+
 static void inbox_dropped_callback(AppMessageResult reason, void *context)
 {
   APP_LOG(APP_LOG_LEVEL_ERROR, "Message dropped!");
+  boost_link(); // make sure the watchdog checks for gaps
+}
+
+static bool is_handshake(DictionaryIterator *iterator)
+{
+    return dict_find(iterator, KEY_INBOX_SIZE) != NULL;
 }
 
 static void outbox_failed_callback(DictionaryIterator *iterator, AppMessageResult reason, void *context)
 {
   APP_LOG(APP_LOG_LEVEL_ERROR, "Outbox send failed!");
+  if (b_handshake_pending && is_handshake(iterator))
+  {   // phone side is probably not ready yet
+      retry_handshake();
+  }
 }
 
 static void outbox_sent_callback(DictionaryIterator *iterator, void *context)
 {
   APP_LOG(APP_LOG_LEVEL_INFO, "Outbox send success!");
+  if (b_handshake_pending && is_handshake(iterator))
+  {
+      trace__mark(TRACE_HANDSHAKE);
+      b_handshake_pending = false;
+  }
 }
 
 ////////////////   E X P O R T E D   F U N C T I O N S   ////////////////
@@ -143,11 +503,20 @@ void js_comm__init()
     app_message_register_outbox_failed(outbox_failed_callback);
     app_message_register_outbox_sent(outbox_sent_callback);
 
-    app_message_open(app_message_inbox_size_maximum(), app_message_outbox_size_maximum());
+    n_inbox_size = choose_inbox_size();
+    APP_LOG(APP_LOG_LEVEL_INFO, "Opening inbox of %u bytes", (unsigned int)n_inbox_size);
+    app_message_open(n_inbox_size, OUTBOX_SIZE);
+    send_handshake(NULL);
 }
 
 void js_comm__deinit()
 {
+    release_link();
+    if (p_handshake_timer)
+    {
+        app_timer_cancel(p_handshake_timer);
+        p_handshake_timer = NULL;
+    }
     app_message_deregister_callbacks();
 }
 
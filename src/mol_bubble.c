@@ -1,79 +1,678 @@
 #include <pebble.h>
+#include <stddef.h>
 #include "mol_bubble.h"
 
-Pending s_pending = { INT32_MAX, true, true };
-Coordinates s_last_known_coords = { 0, 0 };
+Pending s_pending = { INT32_MAX, 0, true, true };
+Coordinates s_last_known_coords = { 0, 0, 0, 0 };
 int s_stations_size = 0;
-Station *s_stations = NULL;
-Station **s_sorted_stations = NULL;
-Station *s_selected_station = NULL; // pointer to selected station
+int s_incoming_size = 0;
+uint8_t *s_ids_received = NULL;
+uint16_t *s_sorted_stations = NULL;
+uint8_t *s_stations_received = NULL;
+uint8_t *s_bikes_received = NULL;
+int s_selected_station = NO_STATION;
+int s_dictionary_size = 0;
+static uint16_t n_dictionary_id = 0; // changes when token ids are reassigned
+uint8_t *s_tokens_received = NULL;
+StationView s_view = VIEW_NEAREST;
 
-static void swap_stations(int a, int b)
+// station data, hot (per fix) first
+static Coordinates *s_coords = NULL;
+static uint16_t *s_distances = NULL; // distance from last known coordinate, in meters
+static CompassHeading *s_bearings = NULL; // bearing from last known coordinate
+static Availability *s_availability = NULL;
+static uint16_t *s_ids = NULL; // ascending, as sent by the phone
+static uint16_t *s_checks = NULL; // checksum of each station record, as sent by the phone
+static uint16_t *s_incoming_ids = NULL; // ids of the announced station set
+static uint16_t *s_incoming_checks = NULL;
+static StringPool s_names = { NULL }; // dictionary encoded
+static StringPool s_tokens = { NULL };
+
+// station indices of each view ordered by distance, VIEW_NEAREST is s_sorted_stations
+static uint16_t *s_view_stations[VIEW_COUNT] = { NULL };
+static int s_view_sizes[VIEW_COUNT] = { 0 };
+static bool b_views_valid = false; // views follow the distance order
+
+// All fixed size station arrays share one arena, field after field for
+// n_capacity stations. It is resized in place with some headroom, so the
+// network gaining a station neither fragments the heap nor drops the data
+// already loaded. Names stay in s_names, which grows in place by itself.
+typedef struct ArenaField
+{
+    void **array;
+    int element_size; // 0 for bitmaps
+} ArenaField;
+static const ArenaField s_arena_fields[] =
+{   // widest alignment first
+    { (void**)&s_bearings, sizeof(CompassHeading) },
+    { (void**)&s_coords, sizeof(Coordinates) },
+    { (void**)&s_availability, sizeof(Availability) },
+    { (void**)&s_distances, sizeof(uint16_t) },
+    { (void**)&s_ids, sizeof(uint16_t) },
+    { (void**)&s_incoming_ids, sizeof(uint16_t) },
+    { (void**)&s_sorted_stations, sizeof(uint16_t) },
+    { (void**)&s_view_stations[VIEW_WITH_BIKES], sizeof(uint16_t) },
+    { (void**)&s_view_stations[VIEW_WITH_RACKS], sizeof(uint16_t) },
+    { (void**)&s_checks, sizeof(uint16_t) },
+    { (void**)&s_incoming_checks, sizeof(uint16_t) },
+    { (void**)&s_stations_received, 0 },
+    { (void**)&s_bikes_received, 0 },
+    { (void**)&s_ids_received, 0 },
+};
+enum { ARENA_FIELDS = ARRAY_LENGTH(s_arena_fields) };
+enum { ARENA_HEADROOM = 8 }; // stations, on top of an eighth of the size
+static uint8_t *p_arena = NULL;
+static int n_capacity = 0;
+
+// last fix, and movement between the last two
+static time_t n_fix_s = 0;
+static uint16_t n_fix_ms = 0;
+static int32_t n_fix_speed = 0; // mm/s
+static CompassHeading n_fix_course = 0;
+
+// dead reckoned from the last fix, for display only, sorting uses the fix
+static int n_estimate_station = NO_STATION;
+static uint16_t n_estimate_distance = 0;
+static CompassHeading n_estimate_bearing = 0;
+
+// persistent storage keys, stations and dictionary chunks follow their base key
+enum
+{
+    PERSIST_STATION_COUNT = 0,
+    PERSIST_STATIONS = 1,
+    PERSIST_DICTIONARY_ID = 0x7FFE,
+    PERSIST_VERSION = 0x7FFF,
+    PERSIST_DICTIONARY_SIZE = 0x8000,
+    PERSIST_DICTIONARY = 0x8001,
+};
+enum { PERSIST_FORMAT = 6 }; // bump when the stored layout changes
+// station sort engines, select one with SORT_ENGINE
+#define SORT_QUICK 0 // comparison quicksort, exact order
+#define SORT_BUCKETS 1 // counting sort on distance buckets, then each bucket sorted
+#ifndef SORT_ENGINE
+#define SORT_ENGINE SORT_BUCKETS
+#endif
+enum { SORT_BENCH_STATIONS = 500, SORT_BENCH_RUNS = 10 };
+// Between fixes the position is dead reckoned from the time since the last
+// fix, the step cadence (if walking) or the speed between the last two fixes,
+// and the compass heading (or the course between the last two fixes).
+enum { DR_MIN_FIX_INTERVAL_MS = 1000, DR_MAX_MS = 60000 }; // fix pairs used for speed, estimate horizon
+enum { DR_MAX_SPEED = 15000 }; // mm/s, anything faster is a jump of the fix
+enum { DR_CADENCE_WINDOW_S = 60, DR_MIN_STEPS = 30, DR_STRIDE_MM = 750 }; // fewer steps is not walking
+enum { AVERAGE_ENCODED_NAME_LENGTH = 12, AVERAGE_TOKEN_LENGTH = 6 }; // initial pool sizes
+
+// persisted station record, name is dictionary encoded and null terminated
+typedef struct PersistedStation
+{
+    uint16_t id;
+    uint16_t check;
+    Coordinates coords;
+    uint16_t racks;
+    char name[MAX_STATION_NAME_LENGTH+1];
+} PersistedStation;
+
+static void sort_stations()
+{
+    if (!s_pending.location)
+    {
+#if SORT_ENGINE == SORT_BUCKETS
+        // filtered views are rebuilt from the result, so one of them is scratch
+        bucket_sort(s_sorted_stations, s_stations_size, s_distances, s_view_stations[VIEW_WITH_BIKES]);
+#else
+        quick_sort(s_sorted_stations, 0, s_stations_size-1, s_distances);
+#endif
+    }
+}
+
+#ifdef SORT_BENCH
+static void bench_sort(const char *input, uint16_t *keys, uint16_t *order, uint16_t *scratch, int n)
+{
+    for (int engine = SORT_QUICK; engine <= SORT_BUCKETS; engine++)
+    {
+        time_t s_start, s_end;
+        uint16_t ms_start, ms_end;
+        time_ms(&s_start, &ms_start);
+        for (int run = 0; run < SORT_BENCH_RUNS; run++)
+        {
+            for (int i = 0; i < n; i++)
+            {
+                order[i] = i;
+            }
+            if (engine == SORT_QUICK)
+                quick_sort(order, 0, n-1, keys);
+            else
+                bucket_sort(order, n, keys, scratch);
+        }
+        time_ms(&s_end, &ms_end);
+        APP_LOG(APP_LOG_LEVEL_INFO, "Sort bench, %d %s stations, %s: %d ms for %d runs",
+                n, input, engine == SORT_QUICK ? "quicksort" : "buckets",
+                (int)((s_end - s_start) * 1000 + ms_end - ms_start), SORT_BENCH_RUNS);
+    }
+}
+
+static void bench_sorts()
+{   // both engines on realistic and adversarial distances
+    int n = SORT_BENCH_STATIONS;
+    uint16_t *keys = malloc(n * sizeof(uint16_t));
+    uint16_t *order = malloc(n * sizeof(uint16_t));
+    uint16_t *scratch = malloc(n * sizeof(uint16_t));
+    for (int i = 0; i < n; i++)
+    {   // uniform in a disc of 5 km around the user
+        keys[i] = sqrt32((uint32_t)(rand() % 5000) * 5000);
+    }
+    bench_sort("scattered", keys, order, scratch, n);
+    for (int i = 0; i < n; i++)
+    {   // nearby stations not received yet
+        keys[i] = i % 4 ? rand() % 1000 : UINT16_MAX;
+    }
+    bench_sort("partly received", keys, order, scratch, n);
+    for (int i = 0; i < n; i++)
+    {
+        keys[i] = n - i;
+    }
+    bench_sort("reversed", keys, order, scratch, n);
+    for (int i = 0; i < n; i++)
+    {
+        keys[i] = 250;
+    }
+    bench_sort("equidistant", keys, order, scratch, n);
+    for (int i = 0; i < n; i++)
+    {   // dense cluster, one far station puts it all in the first bucket
+        keys[i] = i ? 200 + rand() % 100 : 60000;
+    }
+    bench_sort("cluster and outlier", keys, order, scratch, n);
+    free(scratch);
+    free(order);
+    free(keys);
+}
+#endif // SORT_BENCH
+
+static bool in_view(StationView view, Availability a)
+{
+    switch (view)
+    {
+    case VIEW_WITH_BIKES:
+        return a.bikes >= VIEW_MIN_BIKES;
+    case VIEW_WITH_RACKS:
+        return a.racks - a.bikes >= VIEW_MIN_FREE_RACKS;
+    default:
+        return true;
+    }
+}
+
+static int find_row(StationView view, int station)
+{   // binary search by distance, linear search if the order is stale
+    uint16_t *stations = s_view_stations[view];
+    int lo = 0, hi = s_view_sizes[view];
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (s_distances[stations[mid]] < s_distances[station])
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    for (int i = lo; i < s_view_sizes[view] && s_distances[stations[i]] == s_distances[station]; i++)
+    {
+        if (stations[i] == station)
+            return i;
+    }
+    for (int i = 0; i < s_view_sizes[view]; i++)
+    {
+        if (stations[i] == station)
+            return i;
+    }
+    return NO_STATION;
+}
+
+static void view_insert(StationView view, int station)
 {
-    Station* tmp = s_sorted_stations[a];
-    s_sorted_stations[a] = s_sorted_stations[b];
-    s_sorted_stations[b] = tmp;
+    uint16_t *stations = s_view_stations[view];
+    int lo = 0, hi = s_view_sizes[view];
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (s_distances[stations[mid]] <= s_distances[station])
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    memmove(&stations[lo+1], &stations[lo], (s_view_sizes[view]-lo) * sizeof(uint16_t));
+    stations[lo] = station;
+    s_view_sizes[view]++;
 }
 
-static void sort_stations(int start, int end)
+static void view_remove(StationView view, int station)
 {
-    if (!s_pending.location && end > start)
+    int row = find_row(view, station);
+    if (row != NO_STATION)
     {
-        int pivot_index = (start + end) / 2;
-        Station* pivot = s_sorted_stations[pivot_index];
-        swap_stations(pivot_index, end);
-        int chg;
-        for(int i = chg = start; i < end; i++)
+        uint16_t *stations = s_view_stations[view];
+        memmove(&stations[row], &stations[row+1], (s_view_sizes[view]-row-1) * sizeof(uint16_t));
+        s_view_sizes[view]--;
+    }
+}
+
+static void rebuild_views()
+{   // filter distance order into the views
+    s_view_sizes[VIEW_NEAREST] = s_stations_size;
+    for (int view = VIEW_NEAREST+1; view < VIEW_COUNT; view++)
+    {
+        s_view_sizes[view] = 0;
+        for (int i = 0; i < s_stations_size; i++)
         {
-            if(s_sorted_stations[i]->name[0] && s_sorted_stations[i]->distance < pivot->distance)
+            if (in_view(view, s_availability[s_sorted_stations[i]]))
             {
-                swap_stations(i, chg++);
+                s_view_stations[view][s_view_sizes[view]++] = s_sorted_stations[i];
+            }
+        }
+    }
+    b_views_valid = true;
 }
+
+static void sync_selection()
+{   // keep selected station selected in the (reordered) current view
+    int size = view_size();
+    if (size == 0)
+    {   // view emptied, nothing to point at
+        if (s_selected_station != NO_STATION)
+        {
+            s_selected_station = NO_STATION;
+            compass_window__update_station();
         }
-        swap_stations(chg, end);
-        
-        sort_stations(start, chg-1);
-        sort_stations(chg+1, end);
+        return;
+    }
+    MenuIndex selection = station_menu__get_selection();
+    int row = s_selected_station != NO_STATION ? view_row(s_selected_station) : NO_STATION;
+    if (row == NO_STATION)
+    {   // selected station is not in this view, select its neighbour
+        row = selection.row < size ? selection.row : size-1;
+        s_selected_station = view_station(row);
+        compass_window__update_station(); // the menu doesn't notice if the row stays the same
+    }
+    if (row != selection.row)
+    {
+        selection.row = row;
+        station_menu__set_selection(selection, true);
     }
 }
 
-static void persist_write_stations()
+static void availability_changed(int station, Availability before)
+{   // move station in or out of filtered views
+    if (!b_views_valid)
+    {
+        return;
+    }
+    bool current_changed = false;
+    Availability after = s_availability[station];
+    for (int view = VIEW_NEAREST+1; view < VIEW_COUNT; view++)
+    {
+        bool was = in_view(view, before);
+        bool is = in_view(view, after);
+        if (was != is)
+        {
+            if (is)
+                view_insert(view, station);
+            else
+                view_remove(view, station);
+            current_changed |= view == (int)s_view;
+        }
+    }
+    if (current_changed)
+    {
+        sync_selection();
+    }
+}
+
+static void copy_name(char *dst, const char *src, int l)
 {
-    persist_write_int(0, s_stations_size);
-    for (int i = 0; i < s_stations_size; i++)
+    if (l+1 < MAX_STATION_NAME_LENGTH)
+    {
+        memcpy(dst, src, l);
+        dst[l] = '\0';
+    }
+    else
+    {
+        l = MAX_STATION_NAME_LENGTH-4; // ellipsis + terminating null
+        while (src[l] & 0x80)
+            l--; // find last ASCII char
+        strncpy(dst, src, l);
+        dst[l++] = 0xE2; // horizontal ellipsis
+        dst[l++] = 0x80;
+        dst[l++] = 0xA6;
+        dst[l] = '\0';
+    }
+}
+
+static int decode_name(const char *src, char *dst, int size)
+{   // expand dictionary tokens, returns length of (possibly truncated) result
+    int l = 0;
+    for (const uint8_t *p = (const uint8_t*)src; *p && l < size-1; p++)
     {
-        if (s_stations[i].name[0])
+        int token;
+        if (*p < DICT_ESCAPE)
+        {
+            token = *p - 1;
+        }
+        else if (*p == DICT_ESCAPE && p[1])
         {
-            persist_write_data(i+1, &s_stations[i], STATION_PERSIST_SIZE);
+            token = DICT_SHORT_CODES + *++p - 1;
+        }
+        else
+        {   // literal
+            dst[l++] = *p;
+            continue;
+        }
+        const char *str = token < s_dictionary_size ? pool_get(&s_tokens, token) : NULL;
+        for (; str && *str && l < size-1; str++)
+        {
+            dst[l++] = *str;
         }
     }
+    dst[l] = '\0';
+    return l;
+}
+
+static int field_bytes(const ArenaField *field, int capacity)
+{
+    return field->element_size ? field->element_size * capacity : bitmap_size(capacity);
+}
+
+static void log_footprint()
+{
+    int bytes = 0;
+    for (int f = 0; f < ARENA_FIELDS; f++)
+    {
+        bytes += field_bytes(&s_arena_fields[f], n_capacity);
+    }
+    APP_LOG(APP_LOG_LEVEL_INFO, "Station arena: %d bytes for %d/%d stations, names: %d/%d bytes, heap free: %d",
+            bytes, s_stations_size, n_capacity, s_names.size, s_names.capacity, (int)heap_bytes_free());
+}
+
+static bool resize_arena(int capacity)
+{   // move every field to its offset for the new capacity, keeping contents
+    int old_offsets[ARENA_FIELDS], new_offsets[ARENA_FIELDS];
+    int old_bytes = 0, new_bytes = 0;
+    for (int f = 0; f < ARENA_FIELDS; f++)
+    {
+        old_offsets[f] = old_bytes;
+        new_offsets[f] = new_bytes;
+        old_bytes += field_bytes(&s_arena_fields[f], n_capacity);
+        new_bytes += field_bytes(&s_arena_fields[f], capacity);
+    }
+    if (capacity > n_capacity)
+    {   // grow, then spread the fields from the last one
+        uint8_t *arena = realloc(p_arena, new_bytes);
+        if (arena == NULL)
+        {
+            APP_LOG(APP_LOG_LEVEL_ERROR, "Cannot grow station arena to %d bytes!", new_bytes);
+            return false;
+        }
+        p_arena = arena;
+        for (int f = ARENA_FIELDS-1; f >= 0; f--)
+        {
+            int kept = field_bytes(&s_arena_fields[f], n_capacity);
+            memmove(p_arena + new_offsets[f], p_arena + old_offsets[f], kept);
+            memset(p_arena + new_offsets[f] + kept, 0, field_bytes(&s_arena_fields[f], capacity) - kept);
+        }
+    }
+    else if (capacity > 0)
+    {   // pack the fields from the first one, then shrink
+        for (int f = 0; f < ARENA_FIELDS; f++)
+        {
+            memmove(p_arena + new_offsets[f], p_arena + old_offsets[f], field_bytes(&s_arena_fields[f], capacity));
+        }
+        p_arena = realloc(p_arena, new_bytes);
+    }
+    else
+    {
+        free(p_arena);
+        p_arena = NULL;
+    }
+    n_capacity = capacity;
+    for (int f = 0; f < ARENA_FIELDS; f++)
+    {
+        *s_arena_fields[f].array = p_arena ? p_arena + new_offsets[f] : NULL;
+    }
+    s_view_stations[VIEW_NEAREST] = s_sorted_stations;
+    if (s_names.data == NULL)
+    {
+        pool_init(&s_names, capacity, capacity * AVERAGE_ENCODED_NAME_LENGTH);
+    }
+    else
+    {
+        pool_resize(&s_names, capacity);
+    }
+    return true;
+}
+
+static bool reserve_stations(int size)
+{   // make room for size stations, give back room if far too much
+    if (size > n_capacity || size + ARENA_HEADROOM < n_capacity / 2)
+    {
+        bool resized = resize_arena(size + size/8 + ARENA_HEADROOM);
+        log_footprint();
+        return resized;
+    }
+    return true;
+}
+
+static void forget_names()
+{   // stored names are encoded with a dictionary that no longer holds
+    if (s_stations_size)
+    {
+        memset(s_stations_received, 0, bitmap_size(s_stations_size));
+        s_pending.stations = s_stations_size;
+    }
+}
+
+static void move_station(int to, int from)
+{
+    s_ids[to] = s_ids[from];
+    s_checks[to] = s_checks[from];
+    s_coords[to] = s_coords[from];
+    s_distances[to] = s_distances[from];
+    s_bearings[to] = s_bearings[from];
+    s_availability[to] = s_availability[from];
+    s_names.offsets[to] = s_names.offsets[from];
+    bitmap_set(s_stations_received, to);
+}
+
+static void remap_stations()
+{   // move stored stations to their index in the announced set, by id
+    enum { NO_MATCH = 0xFFFF };
+    int size = s_incoming_size, kept = 0;
+    int selected = NO_STATION;
+    uint16_t *matches = s_sorted_stations; // old index of each new one, rebuilt below
+    for (int i = 0, j = 0; i < size; i++)
+    {   // both id lists are ascending
+        while (j < s_stations_size && (s_ids[j] < s_incoming_ids[i] || !bitmap_get(s_stations_received, j)))
+        {
+            j++;
+        }
+        matches[i] = NO_MATCH;
+        if (j < s_stations_size && s_ids[j] == s_incoming_ids[i])
+        {   // same station, stored record is current if it checks the same
+            if (s_checks[j] == s_incoming_checks[i])
+                matches[i] = j;
+            j++;
+        }
+    }
+    // matches are monotone, so moving down ascending, then up descending
+    // never overwrites a station yet to be moved
+    for (int i = 0; i < size; i++)
+    {
+        if (matches[i] != NO_MATCH && matches[i] > i)
+            move_station(i, matches[i]);
+    }
+    for (int i = size-1; i >= 0; i--)
+    {
+        if (matches[i] != NO_MATCH && matches[i] < i)
+            move_station(i, matches[i]);
+    }
+    for (int i = 0; i < size; i++)
+    {
+        if (matches[i] == NO_MATCH)
+        {   // new or changed station, or lost its stored data
+            s_ids[i] = s_incoming_ids[i];
+            s_checks[i] = s_incoming_checks[i];
+            s_names.offsets[i] = POOL_NONE;
+            memset(&s_availability[i], 0, sizeof(Availability));
+            bitmap_clear(s_stations_received, i);
+        }
+        else
+        {
+            if (matches[i] == s_selected_station)
+                selected = i;
+            kept++;
+        }
+        s_sorted_stations[i] = i;
+    }
+    for (int i = size; i < s_stations_size; i++)
+    {
+        s_names.offsets[i] = POOL_NONE;
+        bitmap_clear(s_stations_received, i);
+    }
+    if (kept < s_stations_size)
+    {   // release the names of stations gone or changed, views are rebuilt anyway
+        pool_compact(&s_names, s_view_stations[VIEW_WITH_BIKES]);
+    }
+    APP_LOG(APP_LOG_LEVEL_INFO, "Remapped %d stations, kept %d", size, kept);
+    s_stations_size = size;
+    for (int view = VIEW_NEAREST; view < VIEW_COUNT; view++)
+    {
+        s_view_sizes[view] = view == VIEW_NEAREST ? size : 0;
+    }
+    b_views_valid = false;
+    n_estimate_station = NO_STATION;
+    s_selected_station = selected != NO_STATION || size == 0 ? selected : 0; // lost selection, like select_view()
+    s_pending.stations = size - kept;
+    reserve_stations(size);
+}
+
+static void persist_write_dictionary()
+{   // tokens as (length, bytes) packed into chunks
+    uint8_t chunk[PERSIST_DATA_MAX_LENGTH];
+    int n = 0, key = PERSIST_DICTIONARY;
+    persist_write_int(PERSIST_DICTIONARY_SIZE, s_dictionary_size);
+    persist_write_int(PERSIST_DICTIONARY_ID, n_dictionary_id);
+    for (int i = 0; i < s_dictionary_size; i++)
+    {
+        const char *token = pool_get(&s_tokens, i);
+        int l = token ? strlen(token) : 0;
+        if (n + 1 + l > PERSIST_DATA_MAX_LENGTH)
+        {
+            persist_write_data(key++, chunk, n);
+            n = 0;
+        }
+        chunk[n++] = l;
+        memcpy(&chunk[n], token, l);
+        n += l;
+    }
+    if (n)
+    {
+        persist_write_data(key, chunk, n);
+    }
+}
+
+static void persist_read_dictionary()
+{
+    uint8_t chunk[PERSIST_DATA_MAX_LENGTH];
+    int size = persist_read_int(PERSIST_DICTIONARY_SIZE);
+    persist_delete(PERSIST_DICTIONARY_SIZE);
+    n_dictionary_id = persist_read_int(PERSIST_DICTIONARY_ID);
+    persist_delete(PERSIST_DICTIONARY_ID);
+    reallocate_dictionary(size, n_dictionary_id);
+    for (int i = 0, key = PERSIST_DICTIONARY; i < size; key++)
+    {
+        int n = persist_read_data(key, chunk, sizeof(chunk));
+        persist_delete(key);
+        if (n <= 0)
+        {
+            break;
+        }
+        for (const uint8_t *p = chunk; p < chunk + n && i < size; p += 1 + *p, i++)
+        {
+            if (*p)
+            {
+                set_token(i, (const char*)p+1, *p);
+            }
+        }
+    }
+}
+
+static void persist_write_stations()
+{
+    persist_write_int(PERSIST_VERSION, PERSIST_FORMAT);
+    persist_write_dictionary();
+    persist_write_int(PERSIST_STATION_COUNT, s_stations_size);
+    for (int i = 0; i < s_stations_size; i++)
+    {   // ids of missing stations too, to remap by
+        const char *name = bitmap_get(s_stations_received, i) ? pool_get(&s_names, i) : NULL;
+        PersistedStation record = { .id = s_ids[i], .check = s_checks[i], .coords = s_coords[i], .racks = s_availability[i].racks };
+        strcpy(record.name, name ? name : "");
+        persist_write_data(PERSIST_STATIONS+i, &record, offsetof(PersistedStation, name) + strlen(record.name) + 1);
+    }
 }
 
 static void persist_read_stations()
 {
-    int size = persist_read_int(0);
-    persist_delete(0);
-    reallocate_stations(size);
+    bool valid = persist_read_int(PERSIST_VERSION) == PERSIST_FORMAT;
+    persist_delete(PERSIST_VERSION);
+    if (valid)
+    {
+        persist_read_dictionary();
+    }
+    int stored = persist_read_int(PERSIST_STATION_COUNT);
+    persist_delete(PERSIST_STATION_COUNT);
+    int size = valid && reserve_stations(stored) ? stored : 0;
+    s_stations_size = size;
+    s_pending.stations = size;
+    s_view_sizes[VIEW_NEAREST] = size;
     for (int i = 0; i < size; i++)
     {
-        persist_read_data(i+1, &s_stations[i], STATION_PERSIST_SIZE);
-        persist_delete(i+1);
-        if (s_stations[i].name[0])
+        PersistedStation record = { .id = i ? s_ids[i-1] : 0, .name = { 0 } };
+        persist_read_data(PERSIST_STATIONS+i, &record, sizeof(record));
+        s_ids[i] = record.id;
+        s_checks[i] = record.check;
+        s_sorted_stations[i] = i;
+        if (record.name[0])
         {
+            record.name[MAX_STATION_NAME_LENGTH] = '\0';
+            set_station(i, record.coords, record.racks, record.name, strlen(record.name));
+            bitmap_set(s_stations_received, i);
             s_pending.stations--;
         }
     }
+    for (int i = 0; i < stored; i++)
+    {
+        persist_delete(PERSIST_STATIONS+i);
+    }
+}
+
+static void free_stations()
+{
+    free(p_arena);
+    p_arena = NULL;
+    n_capacity = 0;
+    pool_free(&s_names);
 }
 
 ////////////////   E X P O R T E D   F U N C T I O N S   ////////////////
 
 void init(void)
 {
+#ifdef SORT_BENCH
+    bench_sorts();
+#endif
+    trace__init();
     persist_read_stations();
-    
+    trace__mark(TRACE_PERSIST_READ);
+
     js_comm__init();
     station_menu__init();
     compass_window__init();
+    render_bench__init();
 }
 
 void deinit(void)
@@ -81,43 +680,241 @@ void deinit(void)
     compass_window__deinit();
     station_menu__deinit();
     js_comm__deinit();
-    
+
     persist_write_stations();
-    free(s_stations);
-    free(s_sorted_stations);
+    free_stations();
+    pool_free(&s_tokens);
+    free(s_tokens_received);
 }
 
 void reallocate_stations(int size)
+{   // stored stations stay in place until the ids of the new set arrived
+    if (!reserve_stations(size > s_stations_size ? size : s_stations_size))
+    {
+        size = 0;
+    }
+    s_incoming_size = size;
+    s_pending.ids = size;
+    if (s_ids_received)
+    {
+        memset(s_ids_received, 0, bitmap_size(n_capacity));
+    }
+    if (size == 0)
+    {
+        remap_stations();
+    }
+}
+
+void set_station_id(int station, uint16_t id, uint16_t check)
 {
-    if (s_stations_size == size)
+    if (s_pending.ids && station < s_incoming_size && !bitmap_get(s_ids_received, station))
     {
-        if (s_pending.stations && size)
-        {   // if some are pending, all are pending
-            s_pending.stations = size;
+        s_incoming_ids[station] = id;
+        s_incoming_checks[station] = check;
+        bitmap_set(s_ids_received, station);
+        if (--s_pending.ids == 0)
+        {
+            remap_stations();
+            update_stations();
         }
+    }
+}
+
+void reallocate_dictionary(int size, uint16_t id)
+{
+    if (id != n_dictionary_id)
+    {   // token ids reassigned, or a dictionary of another phone
+        forget_names();
+        if (s_tokens_received)
+        {
+            memset(s_tokens_received, 0, bitmap_size(s_dictionary_size));
+        }
+        n_dictionary_id = id;
+    }
+    if (s_dictionary_size == size)
+    {
         return;
     }
-    free(s_stations);
-    free(s_sorted_stations);
-    s_stations_size = size;
-    s_stations = calloc(s_stations_size, sizeof(Station));
-    s_sorted_stations = calloc(s_stations_size, sizeof(Station*));
-    for (int i = 0; i < size; i++)
+    if (size < s_dictionary_size)
+    {   // names may refer to dropped tokens
+        forget_names();
+    }
+    // token ids are stable across datasets, new ones are appended
+    if (s_tokens.data == NULL)
     {
-        s_sorted_stations[i] = &s_stations[i];
+        pool_init(&s_tokens, size, size * AVERAGE_TOKEN_LENGTH);
     }
-    s_pending.stations = size;
+    else
+    {
+        pool_resize(&s_tokens, size);
+    }
+    s_tokens_received = realloc(s_tokens_received, bitmap_size(size));
+    for (int i = s_dictionary_size < size ? s_dictionary_size : size; i < bitmap_size(size) * 8; i++)
+    {
+        bitmap_clear(s_tokens_received, i);
+    }
+    s_dictionary_size = size;
 }
 
-void update_station(Station *station)
+void set_token(int token, const char *str, int length)
 {
-    if (!s_pending.location)
+    if (token < s_dictionary_size)
+    {
+        const char *old = pool_get(&s_tokens, token);
+        if (old && (strncmp(old, str, length) || old[length]))
+        {
+            forget_names();
+        }
+        pool_set(&s_tokens, token, str, length);
+        bitmap_set(s_tokens_received, token);
+    }
+}
+
+void set_station(int station, Coordinates coords, uint16_t racks, const char *name, int name_length)
+{
+    Availability before = s_availability[station];
+    s_coords[station] = coords;
+    s_availability[station].racks = racks;
+    pool_set(&s_names, station, name, name_length < MAX_STATION_NAME_LENGTH ? name_length : MAX_STATION_NAME_LENGTH);
+    availability_changed(station, before);
+}
+
+void set_station_bikes(int station, uint16_t bikes)
+{
+    Availability before = s_availability[station];
+    s_availability[station].bikes = bikes;
+    availability_changed(station, before);
+}
+
+const char *station_name(int station, char *buf)
+{
+    char decoded[2*MAX_STATION_NAME_LENGTH];
+    const char *name = pool_get(&s_names, station);
+    int l = name ? decode_name(name, decoded, sizeof(decoded)) : 0;
+    copy_name(buf, decoded, l);
+    return buf;
+}
+
+int station_racks(int station)
+{
+    return s_availability[station].racks;
+}
+
+int station_bikes(int station)
+{
+    return s_availability[station].bikes;
+}
+
+uint16_t station_distance(int station)
+{
+    return s_distances[station];
+}
+
+CompassHeading station_bearing(int station)
+{
+    return s_bearings[station];
+}
+
+uint16_t station_estimated_distance(int station)
+{
+    return station == n_estimate_station ? n_estimate_distance : s_distances[station];
+}
+
+CompassHeading station_estimated_bearing(int station)
+{
+    return station == n_estimate_station ? n_estimate_bearing : s_bearings[station];
+}
+
+static int32_t delta(int8_t tile, int16_t pos, int8_t from_tile, int16_t from_pos)
+{   // distance along one axis, clamped to int16
+    int32_t d = (tile - from_tile) * TILE_SIZE + pos - from_pos;
+    return d < -INT16_MAX ? -INT16_MAX : d > INT16_MAX ? INT16_MAX : d;
+}
+
+static void measure(int station, const Coordinates *u, uint16_t *distance, CompassHeading *bearing)
+{   // distance and bearing from u
+    const Coordinates *c = &s_coords[station];
+    int32_t dx = delta(c->tile_x, c->x, u->tile_x, u->x);
+    int32_t dy = delta(c->tile_y, c->y, u->tile_y, u->y);
+    *distance = sqrt32(dx*dx + dy*dy);
+    *bearing = atan2_lookup(dx, -dy);
+}
+
+static int32_t ms_since_fix()
+{
+    time_t s;
+    uint16_t ms;
+    time_ms(&s, &ms);
+    if (n_fix_s == 0 || s - n_fix_s >= INT32_MAX / 1000)
+    {   // no fix yet, or too old to tell
+        return INT32_MAX;
+    }
+    return (s - n_fix_s) * 1000 + ms - n_fix_ms;
+}
+
+static int32_t estimate_speed()
+{   // mm/s
+#ifdef PBL_HEALTH
+    time_t now = time(NULL);
+    if (health_service_metric_accessible(HealthMetricStepCount, now - DR_CADENCE_WINDOW_S, now) & HealthServiceAccessibilityMaskAvailable)
     {
-        int32_t dx = station->coords.x - s_last_known_coords.x;
-        int32_t dy = station->coords.y - s_last_known_coords.y;
-        station->distance = sqrt32(dx*dx + dy*dy);
-        station->bearing = atan2_lookup(dx, -dy);
+        int32_t steps = health_service_sum(HealthMetricStepCount, now - DR_CADENCE_WINDOW_S, now);
+        if (steps >= DR_MIN_STEPS)
+        {
+            return steps * DR_STRIDE_MM / DR_CADENCE_WINDOW_S;
+        }
     }
+#endif
+    return n_fix_speed; // riding, or no step data
+}
+
+void update_station(int station)
+{
+    if (!bitmap_get(s_stations_received, station))
+    {   // sorts last
+        s_distances[station] = UINT16_MAX;
+    }
+    else if (!s_pending.location)
+    {
+        measure(station, &s_last_known_coords, &s_distances[station], &s_bearings[station]);
+    }
+}
+
+void set_position(Coordinates coords)
+{
+    int32_t elapsed = ms_since_fix();
+    if (!s_pending.location && elapsed >= DR_MIN_FIX_INTERVAL_MS && elapsed <= DR_MAX_MS)
+    {
+        const Coordinates *u = &s_last_known_coords;
+        int32_t dx = delta(coords.tile_x, coords.x, u->tile_x, u->x);
+        int32_t dy = delta(coords.tile_y, coords.y, u->tile_y, u->y);
+        int64_t speed = (int64_t)sqrt32(dx*dx + dy*dy) * 1000000 / elapsed;
+        n_fix_speed = speed <= DR_MAX_SPEED ? speed : 0;
+        n_fix_course = atan2_lookup(dx, -dy);
+    }
+    else
+    {   // no recent fix to compare with
+        n_fix_speed = 0;
+    }
+    time_ms(&n_fix_s, &n_fix_ms);
+    s_last_known_coords = coords;
+    n_estimate_station = NO_STATION;
+}
+
+void estimate_station(int station, CompassHeading heading, bool heading_valid)
+{   // only the given station, the rest is updated on the next fix
+    if (s_pending.location || station == NO_STATION || !bitmap_get(s_stations_received, station))
+    {
+        return;
+    }
+    int32_t elapsed = ms_since_fix();
+    int32_t travelled = estimate_speed() * (elapsed < DR_MAX_MS ? elapsed : DR_MAX_MS) / 1000000; // m
+    CompassHeading course = heading_valid ? heading : n_fix_course;
+    Coordinates estimate = s_last_known_coords;
+    estimate.x += travelled * sin_lookup(course) / TRIG_MAX_RATIO;
+    estimate.y -= travelled * cos_lookup(course) / TRIG_MAX_RATIO;
+    measure(station, &estimate, &n_estimate_distance, &n_estimate_bearing);
+    n_estimate_station = station;
 }
 
 void update_stations()
@@ -126,27 +923,54 @@ void update_stations()
     {
         for (int i = 0; i < s_stations_size; i++)
         {
-            update_station(&s_stations[i]);
-        }
-        sort_stations(0, s_stations_size-1);
-    
-        // update selection
-        MenuIndex selection = station_menu__get_selection();
-        if (s_selected_station && s_selected_station != s_sorted_stations[selection.row])
-        {   // find selected station in reordered list
-            for (int i = 0; i < s_stations_size; i++)
-            {
-                if (s_selected_station == s_sorted_stations[i])
-                {
-                    selection.row = i;
-                    break;
-                }
-            }
-            station_menu__set_selection(selection, true);
+            update_station(i);
         }
+        sort_stations();
+        rebuild_views();
+        sync_selection();
+    }
+}
+
+void select_view(StationView view)
+{
+    s_view = view;
+    if (view_size() == 0)
+    {   // nothing to point at
+        s_selected_station = NO_STATION;
+    }
+    else if (s_selected_station == NO_STATION || view_row(s_selected_station) == NO_STATION)
+    {   // selected station is not in this view, select nearest
+        s_selected_station = view_station(0);
+    }
+    station_menu__refresh_list();
+    sync_selection();
+}
+
+const char *view_name(StationView view)
+{
+    switch (view)
+    {
+    case VIEW_WITH_BIKES: return "Nearest with bikes";
+    case VIEW_WITH_RACKS: return "Nearest with free racks";
+    default:              return "Nearest";
     }
 }
 
+int view_size()
+{
+    return s_view_sizes[s_view];
+}
+
+int view_station(int row)
+{
+    return s_view_stations[s_view][row];
+}
+
+int view_row(int station)
+{
+    return find_row(s_view, station);
+}
+
 int main()
 {
     init();
@@ -1,5 +1,8 @@
 #pragma once
 
+//#define RENDER_BENCH // log draw costs of scripted scenarios, see render_bench.h
+//#define SORT_BENCH // log the time of both station sort engines at startup
+
 #ifdef PBL_COLOR
 #define COLOR(...) __VA_ARGS__
 #define BW(...)
@@ -11,6 +14,8 @@
 #include "station_menu.h"
 #include "compass_window.h"
 #include "js_comm.h"
+#include "trace.h"
+#include "render_bench.h"
 #include "utils.h"
     
 // Key values for AppMessage Dictionary
@@ -20,44 +25,101 @@ enum
     KEY_Y,
     KEY_NUM_STATIONS,
     KEY_INDEX,
-    KEY_NAME,
-    KEY_RACKS,
+    KEY_STATIONS,
+    KEY_PLATFORM,
     KEY_UPDATE,
+    KEY_INBOX_SIZE,
+    KEY_SEQ,
+    KEY_RESYNC,
+    KEY_DICTIONARY,
+    KEY_DICTIONARY_SIZE,
+    KEY_TILE,
+    KEY_IDS,
+    KEY_TRACE,
+    KEY_DICTIONARY_ID,
 };
 
+// resync request kinds, see js_comm.c for the KEY_RESYNC layout
+enum { RESYNC_STATIONS, RESYNC_BIKES, RESYNC_COUNT, RESYNC_DICTIONARY, RESYNC_IDS, RESYNC_KINDS };
+
 // other constants
 enum { MAX_STATION_NAME_LENGTH = 32 };
 
+// Station names are sent and stored encoded with a per-dataset token
+// dictionary: bytes 0x01-0x1E stand for the most frequent tokens, 0x1F
+// followed by a byte 0x01-0xFF for the rest, other bytes are literal.
+enum { DICT_SHORT_CODES = 30, DICT_ESCAPE = 0x1F, MAX_DICTIONARY_SIZE = DICT_SHORT_CODES + 255 };
+
 typedef struct Pending
 {
     int stations;
+    int ids; // of the incoming station set
     bool location;
     bool bikes;
 } Pending;
 extern Pending s_pending;
 
 // stations
+// The phone splits the plane around the network into TILE_SIZE squares, and
+// streams only the stations in the tiles around the user, so deltas between
+// the user and any station fit in int16 (clamped beyond that).
+enum { TILE_SIZE = 16384 }; // meters
 typedef struct Coordinates
 {
-    int16_t x, y;
+    int8_t tile_x, tile_y; // tile, relative to the dataset origin
+    int16_t x, y; // position within tile, in meters
 } Coordinates;
 extern Coordinates s_last_known_coords;
 
-typedef struct Station
+typedef struct Availability
 {
-    char name[MAX_STATION_NAME_LENGTH];
-    Coordinates coords; // coordinates relative to city center, in meters
-    uint8_t racks; // number of racks
-    uint8_t bikes; // number of bikes
-    uint16_t distance; // distance from last known coordinate, in meters
-    CompassHeading bearing; // bearing from last known coordinate, in meters
-} Station;
-enum { STATION_PERSIST_SIZE = sizeof(Station)-sizeof(uint8_t)-sizeof(uint16_t)-sizeof(CompassHeading) };
+    uint16_t racks; // number of racks
+    uint16_t bikes; // number of bikes
+} Availability;
+
+// Station data is kept in parallel arrays, indexed by station, so that the
+// per-fix geometry pass and the sort only touch the data they need.
+// Use the accessors below outside mol_bubble.c.
+// A new station set is announced by its size, then its ids (ascending) with
+// a checksum of each record. Once all arrived, stations stored with the same
+// id and checksum are moved to their new index, only the rest are missing.
+enum { NO_STATION = -1 };
 extern int s_stations_size;
-extern Station *s_stations;
-extern Station **s_sorted_stations;
-extern Station *s_selected_station; // pointer to selected station
+extern int s_incoming_size; // size of the announced station set
+extern uint8_t *s_ids_received; // bitmap of ids of the announced set received
+extern uint16_t *s_sorted_stations; // station indices, ordered by distance
+extern uint8_t *s_stations_received; // bitmap of stations received since last (re)allocation
+extern uint8_t *s_bikes_received; // bitmap of bike counts received in current update burst
+extern int s_selected_station; // index of selected station
+extern int s_dictionary_size; // number of name tokens
+extern uint8_t *s_tokens_received; // bitmap of name tokens received
+
+// Views rank stations by distance, optionally only those a user can take a
+// bike from or return one to. Filtered views follow bike count updates
+// incrementally, and are rebuilt from the distance order on each fix.
+typedef enum StationView { VIEW_NEAREST, VIEW_WITH_BIKES, VIEW_WITH_RACKS, VIEW_COUNT } StationView;
+enum { VIEW_MIN_BIKES = 1, VIEW_MIN_FREE_RACKS = 1 };
+extern StationView s_view; // current view
 
-void reallocate_stations(int size);
-void update_station(Station *station);
+void reallocate_stations(int size); // announce station set
+void set_station_id(int station, uint16_t id, uint16_t check); // of the announced set, remaps when all arrived
+void reallocate_dictionary(int size, uint16_t id); // names are forgotten if the id changes
+void set_token(int token, const char *str, int length);
+void set_station(int station, Coordinates coords, uint16_t racks, const char *name, int name_length);
+void set_station_bikes(int station, uint16_t bikes);
+const char *station_name(int station, char *buf); // decodes into buf of MAX_STATION_NAME_LENGTH
+int station_racks(int station);
+int station_bikes(int station);
+uint16_t station_distance(int station); // distance from last known coordinate, in meters
+CompassHeading station_bearing(int station); // bearing from last known coordinate
+uint16_t station_estimated_distance(int station); // dead reckoned if estimated since the last fix, for display
+CompassHeading station_estimated_bearing(int station);
+void update_station(int station);
 void update_stations();
+void set_position(Coordinates coords); // new fix from the phone
+void estimate_station(int station, CompassHeading heading, bool heading_valid); // dead reckoned between fixes
+void select_view(StationView view);
+const char *view_name(StationView view);
+int view_size(); // number of stations in current view
+int view_station(int row); // station at row of current view
+int view_row(int station); // row of station in current view, or NO_STATION
@@ -25,6 +25,61 @@ var Pebble = {
 };
 */
 
+// startup timeline, merged with the watch's milestones into one report
+var StartupTrace = function()
+{
+	this.marks = [];
+	this.handshake = null; // phone time the watch's handshake arrived
+
+	// see TraceMilestone in trace.h
+	this.WATCH_MILESTONES = [ "init", "persist read", "handshake", "first position",
+	                          "station count", "stations complete", "first bikes", "menu resolved" ];
+	this.WATCH_HANDSHAKE = 2;
+	this.WATCH_RESOLVED  = 7;
+	this.NONE = 0xFFFF;
+};
+StartupTrace.prototype.mark = function(name)
+{   // first time only
+	name = "phone: " + name;
+	if (!this.marks.some(function(mark) { return mark.name == name; }))
+	{
+		this.marks.push({ "time": Date.now(), "name": name });
+	}
+};
+StartupTrace.prototype.report = function(data)
+{   // watch sends uint16 LE ms since its init per milestone
+	var watch = [];
+	for (var i = 0; i+1 < data.length; i += 2)
+	{
+		watch.push(data[i] | data[i+1] << 8);
+	}
+	if (this.handshake === null || watch[this.WATCH_HANDSHAKE] == this.NONE)
+	{
+		console.log("Startup trace cannot be aligned without a handshake!");
+		return;
+	}
+	var init = this.handshake - watch[this.WATCH_HANDSHAKE]; // phone time of watch init
+	var marks = this.marks.slice();
+	watch.forEach(function(ms, i)
+	{
+		if (ms != this.NONE)
+		{
+			marks.push({ "time": init + ms, "name": "watch: " + this.WATCH_MILESTONES[i] });
+		}
+	}, this);
+	marks.sort(function(a, b) { return a.time - b.time; });
+	console.log("Startup timeline (aligned on handshake):");
+	marks.forEach(function(mark)
+	{
+		console.log("  +" + (mark.time - marks[0].time) + " ms  " + mark.name);
+	});
+	if (watch[this.WATCH_RESOLVED] != this.NONE)
+	{
+		console.log("Time to interactive: " + watch[this.WATCH_RESOLVED] + " ms");
+	}
+};
+var startupTrace = new StartupTrace();
+
 var MessageQueue = function()
 {
 	this.queue = [];
@@ -34,6 +89,24 @@ var MessageQueue = function()
 	this.ACK_DELAY  = 10;
 	this.NACK_DELAY = 200;
 	this.TIMEOUT    = 1000;
+
+	// dictionary overhead, see Pebble's Dictionary serialization format
+	this.DICT_HEADER  = 1;
+	this.TUPLE_HEADER = 7;
+	this.inboxSize = 256; // smallest inbox the watch ever opens
+	this.platform  = "unknown";
+	this.seq = 0;
+	this.onDrained = null; // called when the queue empties
+};
+MessageQueue.prototype.setInboxSize = function(inboxSize, platform)
+{
+	this.inboxSize = inboxSize;
+	this.platform  = platform;
+	console.log("Watch (" + platform + ") accepts messages up to " + inboxSize + " bytes");
+};
+MessageQueue.prototype.capacity = function(tuples, fixedBytes)
+{   // bytes left for payload in a message with the given number of tuples
+	return this.inboxSize - this.DICT_HEADER - tuples*this.TUPLE_HEADER - fixedBytes;
 };
 MessageQueue.prototype.sendAppMessage = function(message, type, highPrio)
 {
@@ -47,6 +120,11 @@ MessageQueue.prototype.sendAppMessage = function(message, type, highPrio)
 		this.sendNext();
 	}
 };
+MessageQueue.prototype.sendData = function(message, type)
+{   // data messages are numbered, so that the watch can detect lost ones
+	message.seq = this.seq++;
+	this.sendAppMessage(message, type);
+};
 MessageQueue.prototype.sendNext = function()
 {
 	this.sending = true;
@@ -54,6 +132,10 @@ MessageQueue.prototype.sendNext = function()
     if (!message)
 	{
 		this.sending = false;
+		if (this.onDrained)
+		{
+			this.onDrained();
+		}
 		return;
 	}
 
@@ -116,32 +198,241 @@ DistanceCalculator.prototype.toSquare = function(coords)
     var dlon = this.lon - lon2;
     return { "x": Math.round(this.R*this.cos*dlon*1000), "y": Math.round(this.R*dlat*1000) };
 };
-var dc = new DistanceCalculator({ "latitude":47.4925, "longitude":19.0514 }); // Budapest city center
+DistanceCalculator.prototype.TILE_SIZE = 16384; // meters, see mol_bubble.h
+DistanceCalculator.prototype.toTile = function(coords)
+{   // tile, and position within the tile
+    var pos = this.toSquare(coords);
+    var tx = Math.floor(pos.x / this.TILE_SIZE);
+    var ty = Math.floor(pos.y / this.TILE_SIZE);
+    return { "tile_x": tx, "tile_y": ty, "x": pos.x - tx*this.TILE_SIZE, "y": pos.y - ty*this.TILE_SIZE };
+};
+DistanceCalculator.ORIGIN_GRID  = 0.1;    // degrees
+DistanceCalculator.ORIGIN_RESET = 200000; // meters
+DistanceCalculator.centerOf = function(stations)
+{   // calculator with its origin in the middle of the network
+    // The origin is kept across station lists, every stored position on the
+    // watch would be invalidated if it moved. It is only reset when the network
+    // is far away from it, and snapped to a coarse grid so it doesn't follow
+    // the stations coming and going.
+    var lat = 0, lon = 0;
+    stations.forEach(function(station)
+    {
+        lat += station.lat;
+        lon += station.lon;
+    });
+    var center = { "lat": lat / stations.length, "lon": lon / stations.length };
+    var stored = localStorage.getItem("origin");
+    if (stored)
+    {
+        var dc = new DistanceCalculator(JSON.parse(stored));
+        var pos = dc.toSquare(center);
+        if (Math.sqrt(pos.x*pos.x + pos.y*pos.y) < DistanceCalculator.ORIGIN_RESET) return dc;
+    }
+    var grid = DistanceCalculator.ORIGIN_GRID;
+    var origin = { "lat": Math.round(center.lat / grid) * grid, "lon": Math.round(center.lon / grid) * grid };
+    localStorage.setItem("origin", JSON.stringify(origin));
+    return new DistanceCalculator(origin);
+};
+var dc = null; // origin is set when the first station list arrives
 
 // location updater
-var LocationUpdater = function() {};
+var LocationUpdater = function()
+{
+    this.coords = null; // last fix
+
+    // the watch dead reckons between fixes, so it needs few of them, and the
+    // GPS can be off in between instead of tracking continuously
+    this.FIX_INTERVAL = 15000; // ms
+};
 LocationUpdater.prototype.received = function(pos)
 {
     console.log("received updated coordinates: lat=" + pos.coords.latitude + ", lon=" + pos.coords.longitude);
-    msgQueue.sendAppMessage(dc.toSquare(pos.coords), "position", true);
+    this.coords = pos.coords;
+    this.send();
+    this.schedule();
+};
+LocationUpdater.prototype.send = function()
+{   // positions mean nothing to the watch before the origin is known
+    if (!dc || !this.coords)
+    {
+        return;
+    }
+    var pos = dc.toTile(this.coords);
+    msgQueue.sendAppMessage({ "x": pos.x, "y": pos.y, "tile": [ pos.tile_x & 0xFF, pos.tile_y & 0xFF ] }, "position", true);
+    if (pos.tile_x != dataLoader.tile.tile_x || pos.tile_y != dataLoader.tile.tile_y)
+    {
+        dataLoader.setTile(pos);
+    }
 };
 LocationUpdater.prototype.error = function(err)
 {
     console.log("Error recieving updated coordinates!");
+    this.schedule();
 };
-LocationUpdater.prototype.subscribe = function()
+LocationUpdater.prototype.request = function()
 {
-    navigator.geolocation.watchPosition(
+    navigator.geolocation.getCurrentPosition(
         this.received.bind(this), this.error.bind(this),
-        { "enableHighAccuracy": true, "timeout": 10000, "maximumAge": 30000 }
+        { "enableHighAccuracy": true, "timeout": 10000, "maximumAge": this.FIX_INTERVAL / 2 }
     );
 };
+LocationUpdater.prototype.schedule = function()
+{   // next fix, one at a time
+    setTimeout(this.request.bind(this), this.FIX_INTERVAL);
+};
+LocationUpdater.prototype.subscribe = function()
+{
+    this.request();
+};
 var locationUpdater = new LocationUpdater();
 
+// station name dictionary
+var utf8Bytes = function(str)
+{
+    var utf8 = unescape(encodeURIComponent(str));
+    var bytes = [];
+    for (var i = 0; i < utf8.length; i++)
+    {
+        bytes.push(utf8.charCodeAt(i));
+    }
+    return bytes;
+};
+
+var NameDictionary = function(names, previous)
+{   // keep the tokens saving the most bytes, see mol_bubble.h for the encoding
+    // Tokens of the previous dictionary keep their ids, so that names stored on
+    // the watch stay valid, new tokens are appended. Once a previous token is no
+    // longer worth its code, the dictionary is rebuilt under a new id, which
+    // tells the watch to forget the names encoded with the old one.
+    this.SHORT_CODES = 30;
+    this.ESCAPE      = 0x1F;
+    this.MAX_TOKENS  = this.SHORT_CODES + 255;
+
+    var counts = Object.create(null);
+    names.forEach(function(name)
+    {
+        this.tokenize(name).forEach(function(token) { counts[token] = (counts[token] || 0) + 1; });
+    }, this);
+    var gain = function(token) { return counts[token] * (utf8Bytes(token).length - 1); };
+    var candidates = Object.keys(counts).sort(function(a, b) { return gain(b) - gain(a); });
+    var saving = function(token, id)
+    {   // bytes saved over all names, relative to what shipping the token costs
+        var length = utf8Bytes(token).length;
+        return (counts[token] || 0) * (length - this.code(id).length) / (length + 1);
+    }.bind(this);
+
+    this.tokens = [];
+    this.codes = Object.create(null);
+    var kept = previous && previous.id && previous.tokens && previous.tokens.length <= this.MAX_TOKENS &&
+               previous.tokens.every(function(token, id) { return saving(token, id) > 0.5; }); // some slack against churn
+    if (kept)
+    {
+        this.id = previous.id;
+        previous.tokens.forEach(this.add, this);
+    }
+    else
+    {   // any 16 bit value but the previous one, 0 is none
+        do this.id = 1 + Math.floor(Math.random() * 0xFFFF); while (previous && this.id == previous.id);
+    }
+    for (var i = 0; i < candidates.length && this.tokens.length < this.MAX_TOKENS; i++)
+    {
+        if (!this.codes[candidates[i]] && saving(candidates[i], this.tokens.length) > 1) // saves more than shipping it costs
+        {
+            this.add(candidates[i]);
+        }
+    }
+    console.log("Name dictionary #" + this.id + " has " + this.tokens.length + " tokens" + (kept ? "" : ", rebuilt"));
+};
+NameDictionary.prototype.code = function(id)
+{
+    return id < this.SHORT_CODES ? [ id + 1 ] : [ this.ESCAPE, id - this.SHORT_CODES + 1 ];
+};
+NameDictionary.prototype.add = function(token)
+{
+    this.codes[token] = this.code(this.tokens.length);
+    this.tokens.push(token);
+};
+NameDictionary.prototype.tokenize = function(name)
+{   // words with their leading space, digit pairs, anything else char by char
+    return name.match(/ ?[A-Za-z\u00C0-\u024F]+|[0-9]{1,2}|[\s\S]/g) || [];
+};
+NameDictionary.prototype.encode = function(name, maxBytes)
+{   // encoded bytes of name, cut after maxBytes of the original
+    var bytes = [], length = 0;
+    var tokens = this.tokenize(name);
+    for (var i = 0; i < tokens.length; i++)
+    {
+        var token = utf8Bytes(tokens[i]);
+        if (length + token.length > maxBytes)
+        {   // watch adds the ellipsis
+            return bytes.concat(token.slice(0, maxBytes - length));
+        }
+        length += token.length;
+        bytes = bytes.concat(this.codes[tokens[i]] || token);
+    }
+    return bytes;
+};
+
 // station list updater
 var DataLoader = function()
 {
-	this.stations = [];
+	this.all = []; // every station of the network
+	this.stations = []; // stations in the tiles around the user, these are sent to the watch
+	this.tile = { "tile_x": 0, "tile_y": 0 }; // tile of the user
+	this.dictionary = new NameDictionary([]);
+
+	this.TILE_RADIUS = 1; // stream this many tiles around the user's in each direction
+
+	this.MAX_NAME_BYTES = 32; // watch truncates anything longer
+
+	// resync request kinds, see mol_bubble.h
+	this.RESYNC_STATIONS   = 0;
+	this.RESYNC_BIKES      = 1;
+	this.RESYNC_COUNT      = 2;
+	this.RESYNC_DICTIONARY = 3;
+	this.RESYNC_IDS        = 4;
+};
+DataLoader.prototype.stationId = function(station)
+{   // 16 bit id the watch remaps its stored stations by
+    var id = String(station.id), hash = 5381;
+    if (/^\d+$/.test(id) && +id <= 0xFFFF)
+    {
+        return +id;
+    }
+    for (var i = 0; i < id.length; i++)
+    {
+        hash = ((hash * 33) ^ id.charCodeAt(i)) & 0xFFFF;
+    }
+    return hash;
+};
+DataLoader.prototype.stationRecord = function(station)
+{
+    var pos = station.pos;
+    var name = this.dictionary.encode(station.name, this.MAX_NAME_BYTES);
+    var record = [
+        pos.tile_x & 0xFF, pos.tile_y & 0xFF,
+        pos.x & 0xFF, (pos.x >> 8) & 0xFF,
+        pos.y & 0xFF, (pos.y >> 8) & 0xFF,
+        station.spaces & 0xFF, (station.spaces >> 8) & 0xFF,
+        name.length
+    ];
+    return record.concat(name);
+};
+DataLoader.prototype.checksum = function(station)
+{   // watch keeps its stored record only if this matches, covers the raw name
+    // rather than its encoding so that dictionary changes don't invalidate it
+    // CRC-16/CCITT-FALSE
+    var bytes = this.stationRecord(station).slice(0, 8).concat(utf8Bytes(station.name));
+    var crc = 0xFFFF;
+    bytes.forEach(function(b)
+    {
+        crc ^= b << 8;
+        for (var i = 0; i < 8; i++)
+        {
+            crc = crc & 0x8000 ? (crc << 1 ^ 0x1021) & 0xFFFF : (crc << 1) & 0xFFFF;
+        }
+    });
+    return crc;
 };
 DataLoader.prototype.xhrRequest = function(url, type, callback)
 {
@@ -153,62 +444,237 @@ DataLoader.prototype.xhrRequest = function(url, type, callback)
 };
 DataLoader.prototype.sendStationCount = function()
 {
-    msgQueue.sendAppMessage({ "num_stations": this.stations.length }, "station count");
+    msgQueue.sendData({
+        "num_stations":    this.stations.length,
+        "dictionary_size": this.dictionary.tokens.length,
+        "dictionary_id":   this.dictionary.id
+    }, "station count");
 };
-DataLoader.prototype.publishStations = function()
+DataLoader.prototype.sendIds = function(from, to)
 {
-    for (var i = 0; i < this.stations.length; i++)
+    var chunkSize = Math.floor(msgQueue.capacity(3, 8) / 4); // index, seq (int32), then id and checksum (uint16) per station
+    for (var i = from; i < to; i += chunkSize)
     {
-        var station = this.stations[i];
-        var pos = dc.toSquare(station);
-        msgQueue.sendAppMessage({
-            "index": i,
-            "name":  station.name,
-            "x":     pos.x,
-            "y":     pos.y,
-            "racks": station.spaces
-        }, "station #" + i);
+        var ids = [];
+        var end = Math.min(to, i + chunkSize);
+        for (var j = i; j < end; j++)
+        {
+            var station = this.stations[j];
+            var check = this.checksum(station);
+            ids.push(station.watchId & 0xFF, (station.watchId >> 8) & 0xFF, check & 0xFF, check >> 8);
+        }
+        msgQueue.sendData({ "index": i, "ids": ids }, "ids #" + i + "-" + (end-1));
     }
 };
-DataLoader.prototype.updateStations = function()
+DataLoader.prototype.publishDictionary = function(from, to)
 {
-    var chunkSize = 120;
-    for (var i = 0; i < this.stations.length; i += chunkSize)
+    var capacity = msgQueue.capacity(3, 8); // index, seq (int32) and tokens
+    var batch = [], first = from;
+    for (var i = from; i < to; i++)
     {
-        var update = [ i ];
-        var to = Math.min(this.stations.length, i + chunkSize);
-        for (var j = i; j < to; j++)
+        var token = utf8Bytes(this.dictionary.tokens[i]);
+        if (batch.length + 1 + token.length > capacity)
+        {
+            msgQueue.sendData({ "index": first, "dictionary": batch }, "tokens #" + first + "-" + (i-1));
+            batch = [];
+            first = i;
+        }
+        batch = batch.concat([ token.length ], token);
+    }
+    if (batch.length)
+    {
+        msgQueue.sendData({ "index": first, "dictionary": batch }, "tokens #" + first + "-" + (i-1));
+    }
+};
+DataLoader.prototype.publishStations = function(from, to)
+{   // pack as many station records into each message as the watch's inbox allows
+    var capacity = msgQueue.capacity(3, 8); // index, seq (int32) and station records
+    var batch = [], first = from;
+    for (var i = from; i < to; i++)
+    {
+        var record = this.stationRecord(this.stations[i]);
+        if (batch.length + record.length > capacity)
+        {
+            msgQueue.sendData({ "index": first, "stations": batch }, "stations #" + first + "-" + (i-1));
+            batch = [];
+            first = i;
+        }
+        batch = batch.concat(record);
+    }
+    if (batch.length)
+    {
+        msgQueue.sendData({ "index": first, "stations": batch }, "stations #" + first + "-" + (i-1));
+    }
+};
+DataLoader.prototype.updateStations = function(from, to)
+{
+    var chunkSize = Math.floor(msgQueue.capacity(2, 6) / 2); // seq (int32), start index, then uint16 per station
+    for (var i = from; i < to; i += chunkSize)
+    {
+        var update = [ i & 0xFF, (i >> 8) & 0xFF ];
+        var end = Math.min(to, i + chunkSize);
+        for (var j = i; j < end; j++)
         {
             var station = this.stations[j];
-            update.push(station.bikes);
+            update.push(station.bikes & 0xFF, (station.bikes >> 8) & 0xFF);
+        }
+        msgQueue.sendData({ "update": update }, "update #" + i + "-" + (end-1));
+    }
+};
+DataLoader.prototype.resync = function(request)
+{   // watch lost some messages, resend the requested index ranges
+    // request holds (kind, range count, then start and count uint16 LE per range) per kind
+    for (var k = 0; k+1 < request.length; k += 2 + 4*request[k+1])
+    {
+        var kind = request[k];
+        if (kind == this.RESYNC_COUNT)
+        {
+            this.sendStationCount();
+            this.sendIds(0, this.stations.length);
+            continue;
         }
-        msgQueue.sendAppMessage({ "update": update }, "update #" + (i/chunkSize));
+        var limit = kind == this.RESYNC_DICTIONARY ? this.dictionary.tokens.length : this.stations.length;
+        for (var i = k+2; i < k+2 + 4*request[k+1] && i+3 < request.length; i += 4)
+        {
+            var start = request[i]   | request[i+1] << 8;
+            var end   = Math.min(limit, start + (request[i+2] | request[i+3] << 8));
+            console.log("Resending " + ["stations", "bikes", "", "tokens", "ids"][kind] + " #" + start + "-" + (end-1));
+            if (kind == this.RESYNC_BIKES)
+            {
+                this.updateStations(start, end);
+            }
+            else if (kind == this.RESYNC_IDS)
+            {
+                this.sendIds(start, end);
+            }
+            else if (kind == this.RESYNC_DICTIONARY)
+            {
+                this.publishDictionary(start, end);
+            }
+            else
+            {
+                this.publishStations(start, end);
+            }
+        }
+    }
+};
+DataLoader.prototype.selectStations = function()
+{   // pick the stations around the user's tile, returns true if they changed
+    var tile = this.tile, radius = this.TILE_RADIUS;
+    var stations = this.all.filter(function(station)
+    {
+        return Math.abs(station.pos.tile_x - tile.tile_x) <= radius &&
+               Math.abs(station.pos.tile_y - tile.tile_y) <= radius;
+    });
+    var changed = stations.length != this.stations.length ||
+        stations.some(function(station, i) { return station.id != this.stations[i].id; }, this);
+    this.stations = stations;
+    return changed;
+};
+DataLoader.prototype.publish = function(first)
+{   // the watch keeps the stations it has by id, and asks for the rest
+    if (first)
+    {
+        startupTrace.mark("publish started");
+        msgQueue.onDrained = function()
+        {
+            startupTrace.mark("publish drained");
+            msgQueue.onDrained = null;
+        };
+    }
+    this.sendStationCount();
+    if (first) this.publishDictionary(0, this.dictionary.tokens.length);
+    this.sendIds(0, this.stations.length);
+    this.updateStations(0, this.stations.length);
+};
+DataLoader.prototype.setTile = function(tile)
+{   // user moved to another tile
+    this.tile = tile;
+    if (this.selectStations())
+    {
+        console.log("Streaming " + this.stations.length + " stations around tile " + tile.tile_x + "," + tile.tile_y);
+        this.publish(false);
     }
 };
 DataLoader.prototype.update = function(first)
 {
+    startupTrace.mark("xhr sent");
     this.xhrRequest("http://futar.bkk.hu/bkk-utvonaltervezo-api/ws/otp/api/where/bicycle-rental.json", 'GET', function(responseText)
     {
+        startupTrace.mark("xhr loaded");
         var json = JSON.parse(responseText);
-        this.stations = json.data.list;
-        this.stations.sort(function(a,b) { return a.id - b.id; });
-        console.log("Collected data for " + this.stations.length + " stations from futar.bkk.hu");
-        if (first) this.sendStationCount();
-        this.updateStations();
-        if (first) this.publishStations();
+        startupTrace.mark("json parsed");
+        this.all = json.data.list;
+        this.all.forEach(function(station) { station.watchId = this.stationId(station); }, this);
+        this.all.sort(function(a,b) { return a.watchId - b.watchId; });
+        console.log("Collected data for " + this.all.length + " stations from futar.bkk.hu");
+        if (first)
+        {
+            dc = DistanceCalculator.centerOf(this.all);
+            var stored = localStorage.getItem("dictionary");
+            this.dictionary = new NameDictionary(this.all.map(function(station) { return station.name; }),
+                                                 stored ? JSON.parse(stored) : null);
+            localStorage.setItem("dictionary", JSON.stringify({ "id": this.dictionary.id, "tokens": this.dictionary.tokens }));
+            if (locationUpdater.coords) this.tile = dc.toTile(locationUpdater.coords);
+        }
+        this.all.forEach(function(station) { station.pos = dc.toTile(station); });
+        if (this.selectStations() || first)
+        {
+            this.publish(first);
+        }
+        else
+        {
+            this.updateStations(0, this.stations.length);
+        }
+        if (first) locationUpdater.send();
     }.bind(this));
 };
 var dataLoader = new DataLoader();
 
+var HANDSHAKE_TIMEOUT = 3000;
+var handshakeTimer = null;
+
 Pebble.addEventListener('ready', function(e)
 {
     console.log("PebbleKit JS ready!");
+    startupTrace.mark("ready");
     locationUpdater.subscribe();
-    dataLoader.update(true);
+    handshakeTimer = setTimeout(function()
+    {   // no word from the watch, go on with the default message size
+        console.log("No handshake from watch, using default message size!");
+        handshakeTimer = null;
+        dataLoader.update(true);
+    }, HANDSHAKE_TIMEOUT);
 });
 
 Pebble.addEventListener('appmessage', function(e)
 {
     console.log("AppMessage received!");
-    dataLoader.update();
+    if (e.payload.inbox_size)
+    {   // handshake
+        if (startupTrace.handshake === null)
+        {
+            startupTrace.handshake = Date.now();
+            startupTrace.mark("handshake");
+        }
+        msgQueue.setInboxSize(e.payload.inbox_size, e.payload.platform);
+        if (handshakeTimer)
+        {
+            clearTimeout(handshakeTimer);
+            handshakeTimer = null;
+            dataLoader.update(true);
+        }
+    }
+    else if (e.payload.resync)
+    {
+        dataLoader.resync(e.payload.resync);
+    }
+    else if (e.payload.trace)
+    {
+        startupTrace.report(e.payload.trace);
+    }
+    else
+    {
+        dataLoader.update();
+    }
 });
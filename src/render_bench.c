@@ -0,0 +1,228 @@
+#include <pebble.h>
+#include "mol_bubble.h"
+
+#ifdef RENDER_BENCH
+
+enum { BENCH_START_DELAY_MS = 10000, BENCH_STEP_MS = 250, BENCH_PUBLISH_STEPS = 40, BENCH_COMPASS_MS = 30000 };
+enum { MAX_OVERLAYS = 2 };
+typedef enum Scenario { SCENARIO_SCROLL, SCENARIO_PUBLISH, SCENARIO_COMPASS, SCENARIO_COUNT } Scenario;
+static const char *SCENARIO_NAMES[SCENARIO_COUNT] = { "list scroll", "bulk publish", "compass animation" };
+static const char *LAYER_NAMES[RENDER_LAYER_COUNT] = { "menu rows", "icons", "compass" };
+
+typedef struct RenderStats
+{
+    int frames;
+    int timed_frames; // frames with an instrumented layer, see frame_ms
+    uint32_t frame_ms; // from the first instrumented layer to the end of the frame
+    uint16_t max_frame_ms;
+    int calls[RENDER_LAYER_COUNT];
+    uint32_t rows_changed; // screen rows that differ from the previous frame
+    uint32_t pixels_changed; // pixels that differ from the previous frame
+} RenderStats;
+
+static RenderStats s_stats;
+static Window *p_windows[MAX_OVERLAYS] = { NULL };
+static Layer *p_overlays[MAX_OVERLAYS] = { NULL }; // topmost layer, drawn last in each frame
+static uint8_t *p_previous_frame = NULL; // framebuffer copy, to diff each frame against
+static bool b_frame_open = false;
+static time_t n_frame_start_s;
+static uint16_t n_frame_start_ms;
+static Scenario n_scenario = SCENARIO_SCROLL;
+static int n_step = 0;
+static bool b_compass_shown = false;
+
+static int count_changed_pixels(const uint8_t *before, const uint8_t *after, int length)
+{
+    int changed = 0;
+    for (int i = 0; i < length; i++)
+    {
+#ifdef PBL_BW
+        changed += __builtin_popcount(before[i] ^ after[i]); // a bit per pixel
+#else
+        changed += before[i] != after[i]; // a byte per pixel
+#endif
+    }
+    return changed;
+}
+
+static void count_changes(GContext *ctx)
+{   // against a copy of the previous frame
+    GBitmap *frame = graphics_capture_frame_buffer(ctx);
+    if (frame == NULL)
+    {
+        return;
+    }
+    const uint8_t *data = gbitmap_get_data(frame);
+    int bytes_per_row = gbitmap_get_bytes_per_row(frame);
+    int rows = gbitmap_get_bounds(frame).size.h;
+    if (p_previous_frame == NULL)
+    {   // first frame, nothing to compare with
+        p_previous_frame = malloc(rows * bytes_per_row);
+        if (p_previous_frame != NULL)
+        {
+            memcpy(p_previous_frame, data, rows * bytes_per_row);
+        }
+        else
+        {
+            APP_LOG(APP_LOG_LEVEL_ERROR, "Render bench has no memory for a frame copy!");
+        }
+        rows = 0;
+    }
+    for (int y = 0; y < rows; y++)
+    {
+        uint8_t *previous = p_previous_frame + y*bytes_per_row;
+        int changed = count_changed_pixels(previous, data + y*bytes_per_row, bytes_per_row);
+        if (changed)
+        {
+            memcpy(previous, data + y*bytes_per_row, bytes_per_row);
+            s_stats.rows_changed++;
+            s_stats.pixels_changed += changed;
+        }
+    }
+    graphics_release_frame_buffer(ctx, frame);
+}
+
+static void overlay_update(Layer *layer, GContext *ctx)
+{   // end of frame
+    if (b_frame_open)
+    {
+        time_t s;
+        uint16_t ms;
+        time_ms(&s, &ms);
+        uint16_t elapsed = (s - n_frame_start_s) * 1000 + ms - n_frame_start_ms;
+        s_stats.frame_ms += elapsed;
+        s_stats.max_frame_ms = elapsed > s_stats.max_frame_ms ? elapsed : s_stats.max_frame_ms;
+        s_stats.timed_frames++;
+        b_frame_open = false;
+    }
+    s_stats.frames++;
+    count_changes(ctx);
+}
+
+static void log_stats(Scenario scenario)
+{
+    RenderStats *s = &s_stats;
+    APP_LOG(APP_LOG_LEVEL_INFO, "Render bench, %s: %d frames, %d pixels in %d rows changed/frame, %d ms/frame (max %d)",
+            SCENARIO_NAMES[scenario], s->frames,
+            s->frames ? (int)(s->pixels_changed / s->frames) : 0, s->frames ? (int)(s->rows_changed / s->frames) : 0,
+            s->timed_frames ? (int)(s->frame_ms / s->timed_frames) : 0, s->max_frame_ms);
+    for (int layer = 0; layer < RENDER_LAYER_COUNT; layer++)
+    {
+        APP_LOG(APP_LOG_LEVEL_INFO, "Render bench, %s: %d %s draws", SCENARIO_NAMES[scenario], s->calls[layer], LAYER_NAMES[layer]);
+    }
+    memset(s, 0, sizeof(RenderStats));
+}
+
+static bool scenario_step(Scenario scenario, int step, uint32_t *delay)
+{   // returns false when the scenario is over
+    switch (scenario)
+    {
+    case SCENARIO_SCROLL:
+    {   // down to the last row and back up, animated
+        int last = view_size() - 1;
+        if (step > 2*last)
+        {
+            return false;
+        }
+        MenuIndex index = { 0, step <= last ? step : 2*last - step };
+        station_menu__set_selection(index, true);
+        return true;
+    }
+    case SCENARIO_PUBLISH:
+        if (step >= BENCH_PUBLISH_STEPS)
+        {
+            return false;
+        }
+        // what each station batch does
+        station_menu__refresh_icons();
+        station_menu__refresh_list();
+        return true;
+    default:
+        if (step > 0 || s_selected_station == NO_STATION)
+        {
+            return false;
+        }
+        compass_window__show();
+        b_compass_shown = true;
+        *delay = BENCH_COMPASS_MS;
+        return true;
+    }
+}
+
+static void run_step(void *context)
+{
+    uint32_t delay = BENCH_STEP_MS;
+    if (!scenario_step(n_scenario, n_step++, &delay))
+    {
+        log_stats(n_scenario);
+        if (b_compass_shown)
+        {
+            window_stack_pop(true);
+            b_compass_shown = false;
+        }
+        n_scenario++;
+        n_step = 0;
+    }
+    if (n_scenario < SCENARIO_COUNT)
+    {
+        app_timer_register(delay, run_step, NULL);
+    }
+}
+
+////////////////   E X P O R T E D   F U N C T I O N S   ////////////////
+
+void render_bench__init()
+{
+    APP_LOG(APP_LOG_LEVEL_INFO, "Render bench starts in %d ms", BENCH_START_DELAY_MS);
+    app_timer_register(BENCH_START_DELAY_MS, run_step, NULL);
+}
+
+void render_bench__attach(Window *window)
+{
+    for (int i = 0; i < MAX_OVERLAYS; i++)
+    {
+        if (p_windows[i] == NULL)
+        {
+            Layer *window_layer = window_get_root_layer(window);
+            p_windows[i] = window;
+            p_overlays[i] = layer_create(layer_get_bounds(window_layer));
+            layer_set_update_proc(p_overlays[i], overlay_update);
+            layer_add_child(window_layer, p_overlays[i]);
+            return;
+        }
+    }
+}
+
+void render_bench__detach(Window *window)
+{
+    for (int i = 0; i < MAX_OVERLAYS; i++)
+    {
+        if (p_windows[i] == window)
+        {
+            layer_destroy(p_overlays[i]);
+            p_windows[i] = NULL;
+            p_overlays[i] = NULL;
+        }
+    }
+    for (int i = 0; i < MAX_OVERLAYS; i++)
+    {
+        if (p_windows[i] != NULL)
+        {
+            return;
+        }
+    }
+    free(p_previous_frame);
+    p_previous_frame = NULL;
+}
+
+void render_bench__draw(RenderLayer layer)
+{
+    if (!b_frame_open)
+    {
+        time_ms(&n_frame_start_s, &n_frame_start_ms);
+        b_frame_open = true;
+    }
+    s_stats.calls[layer]++;
+}
+
+#endif // RENDER_BENCH
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <pebble.h>
+
+// Draw cost instrumentation with scripted scenarios, logged to the app log.
+// Compiled in only with RENDER_BENCH, see mol_bubble.h.
+typedef enum RenderLayer { RENDER_MENU_ROW, RENDER_ICONS, RENDER_COMPASS, RENDER_LAYER_COUNT } RenderLayer;
+
+#ifdef RENDER_BENCH
+void render_bench__init();
+void render_bench__attach(Window *window); // count frames of window
+void render_bench__detach(Window *window);
+void render_bench__draw(RenderLayer layer); // at the start of each draw of layer
+#else
+#define render_bench__init()
+#define render_bench__attach(window)
+#define render_bench__detach(window)
+#define render_bench__draw(layer)
+#endif
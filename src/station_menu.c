@@ -60,6 +60,7 @@ static GBitmap* get_dither_icon(GContext *ctx, int icon_id)
 
 static void icon_layer_update(Layer *layer, GContext *ctx)
 {
+    render_bench__draw(RENDER_ICONS);
     graphics_context_set_compositing_mode(ctx, GCompOpAssign);
     GRect rect = GRect(10, 2, 32, 32);
     graphics_draw_bitmap_in_rect(ctx, get_icon(ICON_STATIONS), rect);
@@ -89,26 +90,37 @@ static void icon_layer_update(Layer *layer, GContext *ctx)
 
 static uint16_t menu_get_num_rows(MenuLayer *menu_layer, uint16_t section_index, void *callback_context)
 {
-    return s_stations_size;
+    return view_size();
+}
+
+static int16_t menu_get_header_height(MenuLayer *menu_layer, uint16_t section_index, void *callback_context)
+{
+    return s_view == VIEW_NEAREST ? 0 : MENU_CELL_BASIC_HEADER_HEIGHT;
+}
+
+static void menu_draw_header(GContext *ctx, const Layer *cell_layer, uint16_t section_index, void *callback_context)
+{
+    menu_cell_basic_header_draw(ctx, cell_layer, view_name(s_view));
 }
 
 static void menu_draw_row(GContext *ctx, const Layer *cell_layer, MenuIndex *cell_index, void *callback_context)
 {
-    Station *station = s_sorted_stations[cell_index->row];
+    render_bench__draw(RENDER_MENU_ROW);
+    int station = view_station(cell_index->row);
     char buf[64] = { 0 };
     char *p = buf;
     if (!s_pending.stations && !s_pending.location)
     {
-        p += snprintf(p, buf+64-p, "%dm, ", station->distance);
+        p += snprintf(p, buf+64-p, "%dm, ", station_distance(station));
     }
     if (!s_pending.bikes)
     {
-        p += snprintf(p, buf+64-p, "%d bikes", station->bikes);
+        p += snprintf(p, buf+64-p, "%d bikes", station_bikes(station));
     }
     if (!s_pending.stations)
     {
-        if (station->bikes) *p++ = '/';
-        p += snprintf(p, buf+64-p, "%d racks", station->racks);
+        if (station_bikes(station)) *p++ = '/';
+        p += snprintf(p, buf+64-p, "%d racks", station_racks(station));
     }
     else if (p == buf)
     {   // add ellipsis in empty buffer
@@ -116,19 +128,25 @@ static void menu_draw_row(GContext *ctx, const Layer *cell_layer, MenuIndex *cel
         *p++ = 0x80;
         *p++ = 0xA6;
     }
-    menu_cell_basic_draw(ctx, cell_layer, station->name[0] ? station->name : "\xe2\x80\xa6", buf, NULL);
+    char name[MAX_STATION_NAME_LENGTH];
+    station_name(station, name);
+    if (!s_pending.stations && !s_pending.location && !s_pending.bikes)
+    {
+        trace__mark(TRACE_MENU_RESOLVED);
+    }
+    menu_cell_basic_draw(ctx, cell_layer, name[0] ? name : "\xe2\x80\xa6", buf, NULL);
 }
 
 static void menu_selection_changed(MenuLayer *menu_layer, MenuIndex new_index, MenuIndex old_index, void *callback_context)
 {
-    s_selected_station = s_sorted_stations[new_index.row];
+    s_selected_station = view_station(new_index.row);
 }
 
 static void menu_select_click(MenuLayer *menu_layer, MenuIndex *cell_index, void *callback_context)
 {
-    if (!s_pending.stations && !s_pending.location && s_stations_size > 0)
+    if (!s_pending.stations && !s_pending.location && view_size() > 0)
     {
-        s_selected_station = s_sorted_stations[cell_index->row];  // just in case no row is selected yet
+        s_selected_station = view_station(cell_index->row);  // just in case no row is selected yet
         compass_window__show();
     }
 }
@@ -136,11 +154,14 @@ static void menu_select_click(MenuLayer *menu_layer, MenuIndex *cell_index, void
 static void menu_select_long_click(MenuLayer *menu_layer, MenuIndex *cell_index, void *callback_context)
 {
     //js_comm__send_request();
+    select_view((s_view + 1) % VIEW_COUNT);
 }
 
 static MenuLayerCallbacks s_menu_callbacks =
 {	// callbacks must be stack allocated
     .get_num_rows = menu_get_num_rows,
+    .get_header_height = menu_get_header_height,
+    .draw_header = menu_draw_header,
     .draw_row = menu_draw_row,
     .selection_changed = menu_selection_changed,
     .select_click = menu_select_click,
@@ -198,11 +219,13 @@ void station_menu__init()
                               GTextAlignmentCenter);
     layer_set_hidden(text_layer_get_layer(p_error_layer), true);
     layer_add_child(window_layer, text_layer_get_layer(p_error_layer));
+    render_bench__attach(p_window);
 }
 
 void station_menu__deinit()
 {
     stop_animations();
+    render_bench__detach(p_window);
     text_layer_destroy(p_error_layer);
     menu_layer_destroy(p_menu_layer);
     layer_destroy(p_icon_layer);
@@ -0,0 +1,63 @@
+#include <pebble.h>
+#include "mol_bubble.h"
+
+enum { TRACE_NONE = 0xFFFF };
+enum { TRACE_SEND_DELAY_MS = 500, TRACE_RETRY_MS = 1000, TRACE_MAX_RETRIES = 5 };
+static time_t n_start_s = 0;
+static uint16_t n_start_ms = 0;
+static uint16_t p_marks[TRACE_COUNT]; // ms since init, TRACE_NONE if not reached
+static int n_retries = 0;
+
+static uint16_t elapsed_ms()
+{
+    time_t s;
+    uint16_t ms;
+    time_ms(&s, &ms);
+    int32_t elapsed = (s - n_start_s) * 1000 + ms - n_start_ms;
+    return elapsed < TRACE_NONE ? elapsed : TRACE_NONE-1;
+}
+
+static void send_trace(void *context)
+{   // uint16 LE per milestone
+    DictionaryIterator *iter;
+    if (app_message_outbox_begin(&iter) != APP_MSG_OK)
+    {
+        if (n_retries++ < TRACE_MAX_RETRIES)
+        {
+            app_timer_register(TRACE_RETRY_MS, send_trace, NULL);
+        }
+        return;
+    }
+    uint8_t data[2*TRACE_COUNT];
+    for (int i = 0; i < TRACE_COUNT; i++)
+    {
+        data[2*i] = p_marks[i] & 0xFF;
+        data[2*i+1] = p_marks[i] >> 8;
+    }
+    dict_write_data(iter, KEY_TRACE, data, sizeof(data));
+    dict_write_end(iter);
+    app_message_outbox_send();
+}
+
+////////////////   E X P O R T E D   F U N C T I O N S   ////////////////
+
+void trace__init()
+{
+    time_ms(&n_start_s, &n_start_ms);
+    memset(p_marks, 0xFF, sizeof(p_marks)); // TRACE_NONE
+    p_marks[TRACE_INIT] = 0;
+}
+
+void trace__mark(TraceMilestone milestone)
+{   // first time only
+    if (p_marks[milestone] != TRACE_NONE)
+    {
+        return;
+    }
+    p_marks[milestone] = elapsed_ms();
+    APP_LOG(APP_LOG_LEVEL_DEBUG, "Startup milestone %d at %d ms", milestone, p_marks[milestone]);
+    if (milestone == TRACE_MENU_RESOLVED)
+    {   // not from within drawing
+        app_timer_register(TRACE_SEND_DELAY_MS, send_trace, NULL);
+    }
+}
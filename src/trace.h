@@ -0,0 +1,20 @@
+#pragma once
+
+#include <pebble.h>
+
+// startup milestones, in the order they are reported to the phone
+typedef enum TraceMilestone
+{
+    TRACE_INIT,
+    TRACE_PERSIST_READ,
+    TRACE_HANDSHAKE, // phone acknowledged, timelines are aligned on this
+    TRACE_FIRST_POSITION,
+    TRACE_STATION_COUNT,
+    TRACE_STATIONS_COMPLETE,
+    TRACE_FIRST_BIKES,
+    TRACE_MENU_RESOLVED, // first menu row drawn with nothing pending, reports the trace
+    TRACE_COUNT
+} TraceMilestone;
+
+void trace__init();
+void trace__mark(TraceMilestone milestone);
@@ -17,6 +17,226 @@ uint16_t sqrt32(uint32_t n)
     }      
 }
 
+int bitmap_size(int bits)
+{
+    return (bits + 7) / 8;
+}
+
+bool bitmap_get(const uint8_t *bitmap, int i)
+{
+    return bitmap[i/8] & (1 << i%8);
+}
+
+void bitmap_set(uint8_t *bitmap, int i)
+{
+    bitmap[i/8] |= 1 << i%8;
+}
+
+void bitmap_clear(uint8_t *bitmap, int i)
+{
+    bitmap[i/8] &= ~(1 << i%8);
+}
+
+int bitmap_next(const uint8_t *bitmap, int from, int to, bool value)
+{   // index of the first bit in [from, to) equal to value, or to if none
+    uint8_t skip = value ? 0x00 : 0xFF;
+    for (int i = from; i < to; i++)
+    {
+        if (i%8 == 0 && bitmap[i/8] == skip)
+        {   // whole byte is uninteresting
+            i += 7;
+        }
+        else if (bitmap_get(bitmap, i) == value)
+        {
+            return i;
+        }
+    }
+    return to;
+}
+
+static void swap(uint16_t *order, int a, int b)
+{
+    uint16_t tmp = order[a];
+    order[a] = order[b];
+    order[b] = tmp;
+}
+
+void quick_sort(uint16_t *order, int start, int end, const uint16_t *keys)
+{   // recurse into the smaller part only, so the stack stays shallow
+    // Keys equal to the pivot stop both scans, so runs of equal keys (e.g.
+    // stations not received yet) split evenly instead of going quadratic.
+    while (end > start)
+    {
+        uint16_t pivot = keys[order[(start + end) / 2]];
+        int i = start, j = end;
+        while (i <= j)
+        {
+            while (keys[order[i]] < pivot)
+                i++;
+            while (keys[order[j]] > pivot)
+                j--;
+            if (i <= j)
+                swap(order, i++, j--);
+        }
+        if (j - start < end - i)
+        {
+            quick_sort(order, start, j, keys);
+            start = i;
+        }
+        else
+        {
+            quick_sort(order, i, end, keys);
+            end = j;
+        }
+    }
+}
+
+enum { BUCKET_COUNT = 128, BUCKET_INSERTION_MAX = 16 };
+
+void bucket_sort(uint16_t *order, int n, const uint16_t *keys, uint16_t *scratch)
+{   // counting sort on the top bits of the keys, then each bucket sorted
+    static uint16_t ends[BUCKET_COUNT+1];
+    if (n < 2)
+    {
+        return;
+    }
+    uint16_t max = 0;
+    for (int i = 0; i < n; i++)
+    {   // UINT16_MAX is unknown, do not let it stretch the buckets
+        uint16_t key = keys[order[i]];
+        if (key != UINT16_MAX && key > max)
+            max = key;
+    }
+    int shift = 0;
+    while ((max >> shift) >= BUCKET_COUNT)
+    {
+        shift++;
+    }
+    memset(ends, 0, sizeof(ends));
+    for (int i = 0; i < n; i++)
+    {
+        int bucket = keys[order[i]] >> shift;
+        ends[(bucket < BUCKET_COUNT ? bucket : BUCKET_COUNT-1) + 1]++;
+    }
+    for (int b = 0; b < BUCKET_COUNT; b++)
+    {
+        ends[b+1] += ends[b];
+    }
+    for (int i = 0; i < n; i++)
+    {   // stable scatter, ends[b] moves to the end of bucket b
+        int bucket = keys[order[i]] >> shift;
+        scratch[ends[bucket < BUCKET_COUNT ? bucket : BUCKET_COUNT-1]++] = order[i];
+    }
+    memcpy(order, scratch, n * sizeof(uint16_t));
+    // order within each bucket, small ones by insertion, crowded ones (an
+    // outlier can put everything into the first) by quicksort
+    for (int b = 0, begin = 0; b < BUCKET_COUNT; begin = ends[b++])
+    {
+        if (ends[b] - begin > BUCKET_INSERTION_MAX)
+        {
+            quick_sort(order, begin, ends[b]-1, keys);
+            continue;
+        }
+        for (int i = begin+1; i < ends[b]; i++)
+        {
+            uint16_t item = order[i];
+            int j = i;
+            for (; j > begin && keys[order[j-1]] > keys[item]; j--)
+            {
+                order[j] = order[j-1];
+            }
+            order[j] = item;
+        }
+    }
+}
+
+void pool_init(StringPool *pool, int count, int capacity)
+{
+    pool->offsets = malloc(count * sizeof(uint16_t));
+    memset(pool->offsets, 0xFF, count * sizeof(uint16_t)); // POOL_NONE
+    pool->data = malloc(capacity);
+    pool->count = count;
+    pool->size = 0;
+    pool->capacity = capacity;
+}
+
+void pool_free(StringPool *pool)
+{
+    free(pool->offsets);
+    free(pool->data);
+    memset(pool, 0, sizeof(StringPool));
+}
+
+void pool_resize(StringPool *pool, int count)
+{   // strings beyond count are dropped, new ones are not set
+    pool->offsets = realloc(pool->offsets, count * sizeof(uint16_t));
+    if (count > pool->count)
+    {
+        memset(&pool->offsets[pool->count], 0xFF, (count - pool->count) * sizeof(uint16_t)); // POOL_NONE
+    }
+    pool->count = count;
+}
+
+void pool_set(StringPool *pool, int i, const char *str, int length)
+{
+    char *dst = (char*)pool_get(pool, i);
+    if (dst == NULL || (int)strlen(dst) < length)
+    {   // does not fit in place, append
+        if (pool->size + length + 1 > pool->capacity)
+        {
+            int capacity = pool->capacity * 3 / 2;
+            if (capacity < pool->size + length + 1)
+            {
+                capacity = pool->size + length + 1;
+            }
+            pool->data = realloc(pool->data, capacity);
+            pool->capacity = capacity;
+        }
+        pool->offsets[i] = pool->size;
+        pool->size += length + 1;
+        dst = pool->data + pool->offsets[i];
+    }
+    memcpy(dst, str, length);
+    dst[length] = '\0';
+}
+
+const char *pool_get(const StringPool *pool, int i)
+{
+    return pool->offsets[i] == POOL_NONE ? NULL : pool->data + pool->offsets[i];
+}
+
+void pool_compact(StringPool *pool, uint16_t *scratch)
+{   // drop the strings no longer referenced, moving the rest down in place
+    int n = 0;
+    for (int i = 0; i < pool->count; i++)
+    {
+        if (pool->offsets[i] != POOL_NONE)
+            scratch[n++] = i;
+    }
+    quick_sort(scratch, 0, n-1, pool->offsets);
+    int size = 0;
+    uint16_t last = POOL_NONE, moved = 0;
+    for (int k = 0; k < n; k++)
+    {
+        uint16_t *offset = &pool->offsets[scratch[k]];
+        if (*offset != last)
+        {   // shared strings are moved once
+            last = *offset;
+            int length = strlen(pool->data + last) + 1;
+            memmove(pool->data + size, pool->data + last, length);
+            moved = size;
+            size += length;
+        }
+        *offset = moved;
+    }
+    pool->size = size;
+    if (size > 0 && size < pool->capacity)
+    {
+        pool->data = realloc(pool->data, size);
+        pool->capacity = size;
+    }
+}
+
 void stop_animation(Animation** anim)
 {
     if (*anim)
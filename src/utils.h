@@ -3,6 +3,33 @@
 #include <pebble.h>
 
 uint16_t sqrt32(uint32_t n);
+int bitmap_size(int bits);
+bool bitmap_get(const uint8_t *bitmap, int i);
+void bitmap_set(uint8_t *bitmap, int i);
+void bitmap_clear(uint8_t *bitmap, int i);
+int bitmap_next(const uint8_t *bitmap, int from, int to, bool value);
+
+// sort order[] by keys[order[i]], ascending
+void quick_sort(uint16_t *order, int start, int end, const uint16_t *keys); // end inclusive
+void bucket_sort(uint16_t *order, int n, const uint16_t *keys, uint16_t *scratch);
+
+// variable length strings, addressed by index, in one growing buffer
+typedef struct StringPool
+{
+    char *data; // null terminated strings
+    uint16_t *offsets; // offset of each string in data, POOL_NONE if not set
+    int count; // number of strings
+    int size; // bytes used in data
+    int capacity; // bytes allocated for data
+} StringPool;
+enum { POOL_NONE = 0xFFFF };
+void pool_init(StringPool *pool, int count, int capacity);
+void pool_free(StringPool *pool);
+void pool_resize(StringPool *pool, int count);
+void pool_set(StringPool *pool, int i, const char *str, int length);
+const char *pool_get(const StringPool *pool, int i);
+void pool_compact(StringPool *pool, uint16_t *scratch); // scratch holds count indices
+
 void stop_animation(Animation** anim);
 void stop_property_animation(PropertyAnimation** prop_anim);
 void text_layer_set_properties(TextLayer *text_layer,
@@ -0,0 +1,68 @@
+// Checks that adding a station to the network keeps the checksums of the
+// others, so the watch keeps its stored records. Run with: node test/stable_checksums.js
+var assert = require("assert");
+var fs = require("fs");
+var path = require("path");
+var vm = require("vm");
+
+var storage = {};
+var context = {
+    "console":        { "log": function() {} },
+    "setTimeout":     function() { return 0; },
+    "clearTimeout":   function() {},
+    "setInterval":    function() { return 0; },
+    "clearInterval":  function() {},
+    "localStorage":   {
+        "getItem": function(key) { return key in storage ? storage[key] : null; },
+        "setItem": function(key, value) { storage[key] = String(value); }
+    },
+    "navigator":      { "geolocation": { "watchPosition": function() {}, "getCurrentPosition": function() {} } },
+    "Pebble":         {
+        "addEventListener":               function() {},
+        "sendAppMessage":                 function() {},
+        "showSimpleNotificationOnPebble": function() {}
+    }
+};
+vm.createContext(context);
+vm.runInContext(fs.readFileSync(path.join(__dirname, "../src/mol_bubble.js"), "utf8"), context);
+
+var words = [ "tér", "utca", "körút", "híd", "Széll Kálmán", "Batthyány", "Deák Ferenc", "Móricz Zsigmond",
+              "Kossuth Lajos", "Petőfi", "Szent Gellért", "Nyugati", "Keleti", "Margit", "Árpád" ];
+var random = 1;
+var next = function() { random = (random * 1103515245 + 12345) & 0x7FFFFFFF; return random / 0x7FFFFFFF; };
+var network = [];
+for (var i = 0; i < 200; i++)
+{
+    network.push({
+        "id":     String(1000 + i),
+        "name":   words[Math.floor(next() * 4) + 4] + " " + words[Math.floor(next() * 11) + 4] + " " + words[Math.floor(next() * 4)],
+        "lat":    47.40 + next() * 0.20,
+        "lon":    18.95 + next() * 0.20,
+        "spaces": Math.floor(next() * 30)
+    });
+}
+
+var load = function(stations)
+{   // fresh start of the phone app with this station list
+    context.stations = JSON.stringify({ "data": { "list": stations } });
+    vm.runInContext(
+        "dc = null;" +
+        "dataLoader = new DataLoader();" +
+        "dataLoader.xhrRequest = function(url, type, callback) { callback(stations); };" +
+        "dataLoader.update(true);", context);
+    var loader = context.dataLoader, checks = {};
+    loader.all.forEach(function(station) { checks[station.watchId] = loader.checksum(station); });
+    return { "checks": checks, "tokens": loader.dictionary.tokens.slice(), "id": loader.dictionary.id };
+};
+
+var before = load(network);
+// far from the others, so the centroid moves a lot
+var after = load(network.concat([ { "id": "999", "name": "Római part", "lat": 47.60, "lon": 19.06, "spaces": 12 } ]));
+
+Object.keys(before.checks).forEach(function(id)
+{
+    assert.strictEqual(after.checks[id], before.checks[id], "checksum of station " + id + " changed");
+});
+assert.strictEqual(after.id, before.id, "dictionary rebuilt");
+assert.deepStrictEqual(after.tokens.slice(0, before.tokens.length), before.tokens, "token ids changed");
+console.log("ok: " + Object.keys(before.checks).length + " checksums kept");